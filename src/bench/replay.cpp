@@ -0,0 +1,349 @@
+/****
+ * JogWheel decoder and dispatch replay harness
+ *
+ * Built only for the native environment ("pio run -e native"), this runs
+ * the same decoder and dispatch code as the jogwheel, but on the host, so
+ * changes to them can be checked and timed without a jogwheel or a
+ * terminal.
+ *
+ * Run with no arguments, it decodes a set of synthetic spin profiles --
+ * steady spins in each direction at a range of speeds, spin ups and downs,
+ * reversals, jiggling back and forth, and spinning after a coil's resting
+ * level has drifted up past its reset level -- and compares the steps the
+ * decoder finds with the whole cycles the profile turned through. Then it
+ * times playing a detent's worth of actions for a few action plans. The
+ * exit status is 1 if any profile was decoded wrong, so it can be used as
+ * a regression check. (That's why it's a program rather than a Unity suite
+ * under test/ for "pio test": the same main() replays captures and times
+ * the code, and a test runner can't be handed a capture file.)
+ *
+ * Run with the name of a file holding the output of the jogwheel's
+ * "capture" command (see "Capture Stream.txt"), and, optionally, the number
+ * of steps that should be in it, it decodes the recorded samples instead.
+ *
+ * Either way, the decoder is calibrated as it goes, as loop() does on the
+ * jogwheel, and the time it takes per sample is reported in ns and, on x86
+ * hosts, in TSC cycles. (To see what it takes on the jogwheel, use the
+ * "stats" command there.)
+ *
+ * Copyright (C) 2020 D.L. Ehnebuske
+ *
+ * See decoder.h for the license.
+ *
+ ****/
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+#include "../decoder.h"
+#include "../dispatch.h"
+
+// Compile time constants
+#define CAL_EVERY_US        (100000UL)  // How often to recalibrate (CAL_MILLIS, in main.cpp)
+#define CAL_WARMUP_US       (1000000UL) // How long to wait before the first recalibration (CAL_WARMUP_MILLIS)
+#define BENCH_DETENTS       (10000)     // How many detents to play when timing the dispatch
+#define AMP_PER_HZ          (2.5)       // Synthetic pulse peak (ADC counts) per electrical cycle per second
+#define AMP_MAX             (920.0)     // The most the support circuitry lets a pulse reach (~4.5V)
+#define NOISE_AMP           (2)         // Synthetic noise is uniform in 0..NOISE_AMP
+#define CAPTURE_SYNC        (0x5AA5)    // As CAP_SYNC in main.cpp
+#define CAPTURE_SAMPLES     (64)        // As CAP_SAMPLES in main.cpp
+#define CAPTURE_COIL_B      (0x8000)    // As CAP_COIL_B in main.cpp
+#define CAPTURE_WHEEL_SHIFT (12)        // As CAP_WHEEL_SHIFT in main.cpp
+#define CAPTURE_WHEEL(s)    (((s) >> CAPTURE_WHEEL_SHIFT) & 0x03)   // The wheel sample s is from
+
+// Types
+struct speedPoint {                                                 // A point in a spin profile
+    double t;                                                       // Seconds since the start
+    double hz;                                                      // Electrical cycles per second then (cw > 0, cc < 0)
+};
+struct spinProfile {                                                // A synthetic way to turn the wheel
+    const char *name;                                               // What to call it
+    double theta0;                                                  // Starting electrical angle (cycles); chosen so both coils are low
+    std::vector<speedPoint> speed;                                  // Speed vs time, linearly interpolated between the points
+    double driftT;                                                  // When (seconds) coil A's resting level jumps up by drift
+    int drift;                                                      // How far (ADC counts) it jumps, if at all
+};
+struct decodeResult {                                               // What came of decoding a run of samples
+    long cw;                                                        // Steps cw
+    long cc;                                                        // Steps cc
+    long samples;                                                   // Samples decoded
+    double ns;                                                      // Time spent decoding them
+    double cycles;                                                  // ...in TSC cycles, if there's a TSC
+};
+
+// Globals
+long opsPlayed = 0;                                                 // How many actions playOp() has been asked to play
+long amountPlayed = 0;                                              // The sum of their scaled amounts (so nothing's optimized away)
+
+// Stand in for main.cpp's playOp(), which sends HID reports
+void playOp(const actionOp *op, int16_t scale) {
+    opsPlayed++;
+    amountPlayed += ((op->x + op->y) * scale + op->code) * op->reps;
+}
+
+// A monotonic time in ns and, if there is one, the TSC
+static double nowNs() {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+static double nowCycles() {
+    #ifdef HAVE_TSC
+    return (double)__rdtsc();
+    #else
+    return 0;
+    #endif
+}
+
+// Recalibrate d's levels the way calibrate() in main.cpp does, if it's time
+static void maybeCalibrate(coilDecoder &d, uint32_t &lastCal) {
+    if (d.clock < CAL_WARMUP_US || d.clock - lastCal < CAL_EVERY_US) {
+        return;
+    }
+    lastCal = d.clock;
+    for (uint8_t c = 0; c < 2; c++) {
+        uint16_t trigger, reset;
+        levelsFor(d.calFloor[c] >> CAL_SHIFT, d.calNoise[c], d.calPeak[c], trigger, reset);
+        d.triggerLevel[c] = trigger;
+        d.resetLevel[c] = reset;
+    }
+}
+
+// Decode the samples, each of which is an ADC value | (CAPTURE_COIL_B if from coil B), timing the lot. (Timing 
+// each sample would take longer than decoding it.) gapBefore, if not empty, is the μs missing before each sample
+static decodeResult decode(coilDecoder &d, const std::vector<uint16_t> &samples, const std::vector<uint32_t> &gapBefore) {
+    decodeResult r = {0, 0, (long)samples.size(), 0, 0};
+    uint32_t lastCal = 0;
+    double t0 = nowNs();
+    double c0 = nowCycles();
+    for (size_t i = 0; i < samples.size(); i++) {
+        d.clock += gapBefore.empty() ? 0 : gapBefore[i];
+        int8_t steps = decodeSample(d, (samples[i] & CAPTURE_COIL_B) != 0 ? COIL_B : COIL_A, samples[i] & 0x3FF);
+        if (steps > 0) {
+            r.cw += steps;
+        } else {
+            r.cc -= steps;
+        }
+        maybeCalibrate(d, lastCal);
+    }
+    r.cycles = nowCycles() - c0;
+    r.ns = nowNs() - t0;
+    return r;
+}
+
+// Print how decoding went. Returns true if the net steps are exactly expected
+static bool report(const char *name, const decodeResult &r, long expected) {
+    long net = r.cw - r.cc;
+    bool ok = net == expected;
+    printf("%-28s expected %5ld  found %5ld (cw %5ld, cc %5ld)  %-4s %6.1f ns/sample", name, expected, net, r.cw, r.cc,
+        ok ? "ok" : "FAIL", r.ns / r.samples);
+    #ifdef HAVE_TSC
+    printf("  %6.1f cycles/sample", r.cycles / r.samples);
+    #endif
+    printf("\n");
+    return ok;
+}
+
+// Make the samples for profile p: each coil's induced voltage is proportional to the speed times sin of the
+// electrical angle (B a quarter cycle behind A), clamped to what the support circuitry lets through, plus
+// noise. Returns the steps the profile should produce: the counts it turned through, rounded to whole
+// counts (summing the angle leaves it a hair off), in COUNTS_PER_STEP units.
+static long synthesize(const spinProfile &p, std::vector<uint16_t> &samples) {
+    const double pi = 3.14159265358979323846;
+    double theta = p.theta0;
+    double tEnd = p.speed.back().t;
+    size_t seg = 0;
+    srand(1);
+    samples.clear();
+    for (long i = 0; ; i++) {
+        double t = i * SAMPLE_US / 1e6;
+        if (t >= tEnd) {
+            break;
+        }
+        while (seg + 2 < p.speed.size() && t >= p.speed[seg + 1].t) {
+            seg++;
+        }
+        const speedPoint &a = p.speed[seg];
+        const speedPoint &b = p.speed[seg + 1];
+        double hz = a.hz + (b.hz - a.hz) * (t - a.t) / (b.t - a.t);
+        theta += hz * SAMPLE_US / 1e6;
+        uint8_t c = i & 1;
+        double v = AMP_PER_HZ * hz * sin(2 * pi * (theta - c * 0.25));
+        v = v < 0 ? 0 : v > AMP_MAX ? AMP_MAX : v;
+        v += c == COIL_A && p.drift != 0 && t >= p.driftT ? p.drift : 0;
+        samples.push_back((uint16_t)(v + rand() % (NOISE_AMP + 1)) | (c == COIL_B ? CAPTURE_COIL_B : 0));
+    }
+    return lround((theta - p.theta0) * COUNTS_PER_CYCLE) / COUNTS_PER_STEP;
+}
+
+// Replay a capture stream from the file named name, expecting expected steps (or, if < 0, not saying)
+static int replayCapture(const char *name, long expected) {
+    FILE *f = fopen(name, "rb");
+    if (f == NULL) {
+        perror(name);
+        return 2;
+    }
+    std::vector<uint8_t> bytes;
+    int ch;
+    while ((ch = fgetc(f)) != EOF) {
+        bytes.push_back(ch);
+    }
+    fclose(f);
+
+    // Pick the blocks out of the stream: sync (2), seq, count, dropped (2), timestamp (4), samples
+    std::vector<uint16_t> samples;
+    std::vector<uint32_t> gapBefore;
+    long blocks = 0;
+    long dropped = 0;
+    const size_t headSize = 10;
+    for (size_t i = 0; i + headSize <= bytes.size(); ) {
+        uint16_t sync = bytes[i] | bytes[i + 1] << 8;
+        uint8_t count = bytes[i + 3];
+        size_t size = headSize + 2 * count;
+        if (sync != CAPTURE_SYNC || count != CAPTURE_SAMPLES || i + size > bytes.size()) {
+            i++;
+            continue;
+        }
+        uint16_t lost = bytes[i + 4] | bytes[i + 5] << 8;
+        for (uint8_t s = 0; s < count; s++) {
+            samples.push_back(bytes[i + headSize + 2 * s] | bytes[i + headSize + 2 * s + 1] << 8);
+            gapBefore.push_back(s == 0 ? (uint32_t)lost * SAMPLE_US : 0);
+        }
+        dropped += lost;
+        blocks++;
+        i += size;
+    }
+    printf("%s: %ld blocks, %ld samples, %ld dropped\n", name, blocks, (long)samples.size(), dropped);
+    if (samples.empty()) {
+        return 2;
+    }
+
+    // With more than one wheel, the samples go round robin through the wheels' coils. Decode wheel 0's.
+    unsigned wheels = 1;
+    for (size_t i = 0; i < samples.size(); i++) {
+        unsigned w = CAPTURE_WHEEL(samples[i]);
+        wheels = w + 1 > wheels ? w + 1 : wheels;
+    }
+    if (wheels > 1) {
+        std::vector<uint16_t> mine;
+        std::vector<uint32_t> gap;
+        uint32_t missing = 0;
+        for (size_t i = 0; i < samples.size(); i++) {
+            missing += gapBefore[i];
+            if (CAPTURE_WHEEL(samples[i]) == 0) {
+                mine.push_back(samples[i]);
+                gap.push_back(missing);
+                missing = 0;
+            }
+        }
+        samples.swap(mine);
+        gapBefore.swap(gap);
+        printf("%u wheels; decoding wheel 0's %ld samples\n", wheels, (long)samples.size());
+    }
+    coilDecoder d;
+    initDecoder(d);
+    d.sampleUs = SAMPLE_US * wheels;
+    decodeResult r = decode(d, samples, gapBefore);
+    bool ok = report(name, r, expected < 0 ? r.cw - r.cc : expected);
+    printf("Levels at the end: A %u/%u, B %u/%u (trigger/reset)\n", d.triggerLevel[COIL_A], d.resetLevel[COIL_A],
+        d.triggerLevel[COIL_B], d.resetLevel[COIL_B]);
+    return ok ? 0 : 1;
+}
+
+// Time playing BENCH_DETENTS detents, one at a time, with plan p
+static void benchDispatch(const char *name, const actionPlan &p) {
+    opsPlayed = 0;
+    double t0 = nowNs();
+    for (long i = 0; i < BENCH_DETENTS; i++) {
+        playDetents(p, (i & 1) != 0 ? 1 : -1, 0xFFFF);
+    }
+    double ns = nowNs() - t0;
+    printf("%-28s %6.1f ns/detent, %5.1f actions/detent\n", name, ns / BENCH_DETENTS, (double)opsPlayed / BENCH_DETENTS);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) {
+        return replayCapture(argv[1], argc > 2 ? atol(argv[2]) : -1);
+    }
+
+    // Decode the synthetic profiles. Clockwise ones start at angle 0, where A's pulse begins, and
+    // counterclockwise ones at a quarter cycle, where B's does, so both coils are low to begin with and
+    // each direction is the other's mirror image. Changes of direction take 20ms and turn whole cycles
+    // each way.
+    const std::vector<spinProfile> profiles = {
+        {"steady cw 8Hz (lone pulses)", 0.0, {{0, 8}, {4, 8}}, 0, 0},
+        {"steady cc 8Hz (lone pulses)", 0.25, {{0, -8}, {4, -8}}, 0, 0},
+        {"steady cw 20Hz", 0.0, {{0, 20}, {2, 20}}, 0, 0},
+        {"steady cc 20Hz", 0.25, {{0, -20}, {2, -20}}, 0, 0},
+        {"steady cw 150Hz", 0.0, {{0, 150}, {1, 150}}, 0, 0},
+        {"steady cw 400Hz", 0.0, {{0, 400}, {0.5, 400}}, 0, 0},
+        {"spin up and down cw", 0.0, {{0, 10}, {1, 200}, {2, 10}}, 0, 0},
+        {"spin up and down cc", 0.25, {{0, -10}, {1, -200}, {2, -10}}, 0, 0},
+        {"reverse cw to cc", 0.0, {{0, 20}, {1, 20}, {1.01, 0}, {1.02, -20}, {2.02, -20}}, 0, 0},
+        {"reverse cc to cw", 0.25, {{0, -20}, {1, -20}, {1.01, 0}, {1.02, 20}, {2.02, 20}}, 0, 0},
+        {"jiggle", 0.0, {{0, 0}, {0.01, 12.5}, {0.02, 0}, {0.03, -12.5}, {0.04, 0}, {0.05, 12.5}, {0.06, 0},
+                         {0.07, -12.5}, {0.08, 0}}, 0, 0},
+        {"coil A resting high, cw 20Hz", 0.0, {{0, 0}, {4, 0}, {4, 20}, {6, 20}}, 1.5, 40},
+    };
+    bool allOk = true;
+    std::vector<uint16_t> samples;
+    printf("Decoding (COUNTS_PER_STEP %d)\n", COUNTS_PER_STEP);
+    for (const spinProfile &p : profiles) {
+        long expected = synthesize(p, samples);
+        coilDecoder d;
+        initDecoder(d);
+        allOk &= report(p.name, decode(d, samples, std::vector<uint32_t>()), expected);
+    }
+
+    // Check the acceleration: slow turns, and the first detent after a pause, at any level, aren't accelerated
+    struct accelCase {
+        uint16_t count, interval;
+        uint8_t level;
+        uint16_t expected;
+    };
+    const accelCase accelCases[] = {
+        {1, ACCEL_NO_INTERVAL, ACCEL_MAX_LEVEL, 1},
+        {1, ACCEL_MAX_LEVEL * ACCEL_KNEE_US, ACCEL_MAX_LEVEL, 1},
+        {1, ACCEL_MAX_LEVEL * ACCEL_KNEE_US / 4, ACCEL_MAX_LEVEL, 4},
+        {2, ACCEL_KNEE_US / 2, 1, 4},
+        {3, 100, ACCEL_MAX_LEVEL, MAX_BATCH},
+        {5, 1000, 0, 5},
+    };
+    printf("Accelerating\n");
+    for (const accelCase &c : accelCases) {
+        uint16_t got = accelerate(c.count, c.interval, c.level);
+        printf("%u detents %5uus apart, level %u: %3u (expected %3u)%s\n", c.count, c.interval, c.level, got,
+            c.expected, got == c.expected ? "" : "  WRONG");
+        allOk &= got == c.expected;
+    }
+
+    // Time the dispatch: one key, once and repeated, a 40-key sequence and a scaled wheel roll
+    static actionPlan plan;
+    printf("Dispatching\n");
+    plan = actionPlan();
+    plan.nOps[ENTRY_CW] = plan.nOps[ENTRY_CC] = 1;
+    plan.op[ENTRY_CW][0] = {opKey, 0, 0x52, 0, 0, 1};
+    plan.op[ENTRY_CC][0] = {opKey, 0, 0x51, 0, 0, 1};
+    benchDispatch("one key", plan);
+    plan.op[ENTRY_CW][0].reps = plan.op[ENTRY_CC][0].reps = 10;
+    benchDispatch("one key, repeated 10 times", plan);
+    plan.nOps[ENTRY_CW] = plan.nOps[ENTRY_CC] = PLAN_MAX_OPS;
+    for (uint8_t i = 0; i < PLAN_MAX_OPS; i++) {
+        plan.op[ENTRY_CW][i] = {opKey, 0x02, (uint8_t)(0x04 + i % 26), 0, 0, 1};
+        plan.op[ENTRY_CC][i] = {opKey, 0x00, (uint8_t)(0x04 + i % 26), 0, 0, 1};
+    }
+    benchDispatch("40 keys", plan);
+    plan.nOps[ENTRY_CW] = plan.nOps[ENTRY_CC] = 1;
+    plan.scalable[ENTRY_CW] = plan.scalable[ENTRY_CC] = true;
+    plan.accel = 3;
+    plan.op[ENTRY_CW][0] = {opWheel, 0, 0, 1, 0, 1};
+    plan.op[ENTRY_CC][0] = {opWheel, 0, 0, -1, 0, 1};
+    benchDispatch("wheel, accel 3", plan);
+
+    printf(allOk ? "All profiles decoded and accelerated correctly.\n" : "Some profiles were decoded or accelerated wrong.\n");
+    return allOk ? 0 : 1;
+}
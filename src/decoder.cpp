@@ -0,0 +1,237 @@
+/****
+ * JogWheel coil pulse decoder
+ *
+ * Copyright (C) 2020 D.L. Ehnebuske
+ *
+ * See decoder.h for the license.
+ *
+ ****/
+
+#include "decoder.h"
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#else
+#define PROGMEM
+#define pgm_read_byte(p)    (*(const uint8_t *)(p))
+#endif
+
+// Move coil c's noise floor and noise running averages toward the sample coilVal
+static inline void trackFloor(coilDecoder &d, uint8_t c, int16_t coilVal) {
+    uint16_t fl = d.calFloor[c];
+    int16_t dev = coilVal - (int16_t)(fl >> CAL_SHIFT);
+    d.calFloor[c] = fl - (fl >> CAL_SHIFT) + coilVal;
+    d.calNoise[c] = d.calNoise[c] - (d.calNoise[c] >> CAL_SHIFT) + (dev < 0 ? -dev : dev);
+}
+
+const int8_t quadStep[16] PROGMEM = {                               // Quadrature counts for [old coil levels << 2 | new levels]
+     0,  1, -1,  0,                                                 // From neither coil high (levels bit 0 is A, bit 1 is B)
+    -1,  0,  0,  1,                                                 // From A high
+     1,  0,  0, -1,                                                 // From B high
+     0, -1,  1,  0                                                  // From both high
+};
+
+// void initDecoder(coilDecoder &d) Put d in its initial state, with the default trigger and reset levels
+void initDecoder(coilDecoder &d) {
+    d.clock = 0;
+    d.sampleUs = SAMPLE_US;
+    d.unpaired = NO_COIL;
+    d.levels = 0;
+    d.overlapped = false;
+    d.counts = 0;
+    d.edges = 0;
+    for (uint8_t c = 0; c < 2; c++) {
+        d.state[c] = low;
+        d.risingTimestamp[c] = 0;
+        d.peak[c] = 0;
+        d.lastPeak[c] = 0;
+        #ifdef FILTER_MEDIAN
+        d.prevVal[c][0] = d.prevVal[c][1] = 0;
+        #endif
+        #ifdef FILTER_IIR
+        d.filtered[c] = 0;
+        #endif
+        d.calFloor[c] = 0;
+        d.calNoise[c] = 0;
+        d.calPeak[c] = 1023;
+    }
+    d.triggerLevel[COIL_A] = TRIGGER_A;
+    d.triggerLevel[COIL_B] = TRIGGER_B;
+    d.resetLevel[COIL_A] = RESET_A;
+    d.resetLevel[COIL_B] = RESET_B;
+}
+
+/****
+ *
+ * int8_t decodeSample(coilDecoder &d, uint8_t c, int16_t coilVal) Decode the sample coilVal of coil c.
+ * Samples are expected to alternate between the coils, one every d.sampleUs μs. Returns the number of whole
+ * steps (cw > 0, cc < 0) the sample completes, which is usually 0.
+ *
+ * Optionally, each coil's samples are filtered before its state machine
+ * sees them. With FILTER_MEDIAN, a sample is replaced by the median of it
+ * and the coil's two previous samples, which gets rid of single-sample
+ * spikes without rounding off the pulses. With FILTER_IIR, the samples go
+ * through a single-pole low-pass filter, y += (x - y) / 2^FILTER_SHIFT,
+ * done in fixed point with the output kept << FILTER_SHIFT so it doesn't
+ * lose the fraction. If both are defined, the median comes first. Either
+ * way, it's a few adds, compares and shifts, and the noise floor and
+ * levels levelsFor() works out are those of the filtered samples.
+ *
+ * There are two identical state machines, one for each coil. A coil's
+ * machine is in one of three states: *low* (its initial state), *rising*,
+ * or *rose*.
+ *
+ * In state *low*, the machine is waiting for the induced voltage on its coil
+ * to rise. If, while in state *low*, the voltage rises above triggerLevel[c]
+ * the machine for the coil enters state *rising*. (Where c is the coil index
+ * -- 0 for coil A, 1 for coil B.) If the voltage has not risen, the machine
+ * stays in state *low*. Either way, if the sample is below resetLevel[c],
+ * it goes into the running averages of the coil's noise floor and of how
+ * far the samples stray from it, which levelsFor() uses to work out the
+ * coil's trigger and reset levels. (Samples between the two levels are
+ * mostly the flanks of pulses. While the wheel spins steadily, letting them
+ * in drags the floor, and so the levels, up after the pulses until they're
+ * missed.)
+ *
+ * In state *rising* the machine notes the time, counts the rising edge on
+ * its coil (see below) and changes state to *rose*.
+ *
+ * In state *rose* the machine is waiting for the induced voltage to drop
+ * below resetLevel[c], where c is the coil index, keeping track of the
+ * highest value the pulse reaches. If it has, the machine counts the
+ * falling edge, switches to state *low* and the pulse's peak goes into the
+ * coil's typical peak, which follows smaller pulses (from turning the wheel
+ * slowly) more closely than bigger ones. Otherwise it remains in state
+ * "rose*." No pulse lasts STUCK_HIGH_US, so if the machine has been in
+ * state *rose* that long, the coil's resting level must have drifted up
+ * past its reset level. From then on, the samples go into the noise floor
+ * and noise averages, as they would in state *low*, until recalibrating
+ * lifts the reset level above where the coil now rests and the machine
+ * drops back to state *low*.
+ *
+ * Taken together, whether each coil's machine is in state *low* or not
+ * gives two levels that behave like the A and B channels of a quadrature
+ * encoder: turning clockwise, A goes high, then B, then A goes low, then B.
+ * Each edge is counted according to quadStep, +1 if it's a step clockwise
+ * through that sequence, -1 if counterclockwise, so there are
+ * COUNTS_PER_CYCLE counts per A and B pulse pair and a change of direction
+ * part way through a pulse is counted correctly.
+ *
+ * For this to work, the A and B pulses have to overlap. When the wheel is
+ * turned slowly, they may not: A goes high and low before B goes high. The
+ * edges of such a "lone" pulse count +1 and then -1, so they cancel out,
+ * and whether it's clockwise or counterclockwise depends on the timing. So,
+ * when a coil's lone pulse ends, the machine checks whether the other coil
+ * had the previous lone pulse and it started less than MAX_PULSE_SEP μs
+ * earlier. If so, the pulse pair is counted as a whole cycle: clockwise if
+ * B followed A, counterclockwise if A followed B. Either way, the pulse pair
+ * is used up, so the long gap from B's pulse to the next A pulse isn't
+ * mistaken for a counterclockwise cycle. (Counts aren't reported while a
+ * lone pulse is under way, so it doesn't make the wheel seem to step
+ * forward and back.)
+ *
+ * Every COUNTS_PER_STEP counts make a step.
+ *
+ * Time is kept by counting samples, d.sampleUs μs each, rather than by
+ * asking a clock. That's cheaper on the jogwheel and means a replay on a
+ * host decodes exactly as the jogwheel did. (Whoever changes how often the
+ * samples are taken has to change d.sampleUs to match.)
+ *
+ ****/
+int8_t decodeSample(coilDecoder &d, uint8_t c, int16_t coilVal) {
+    d.clock += d.sampleUs;
+
+    // Filter the sample, if we're doing that
+    #ifdef FILTER_MEDIAN
+    int16_t lo = d.prevVal[c][0] < d.prevVal[c][1] ? d.prevVal[c][0] : d.prevVal[c][1];
+    int16_t hi = d.prevVal[c][0] < d.prevVal[c][1] ? d.prevVal[c][1] : d.prevVal[c][0];
+    d.prevVal[c][0] = d.prevVal[c][1];
+    d.prevVal[c][1] = coilVal;
+    coilVal = coilVal < lo ? lo : coilVal > hi ? hi : coilVal;
+    #endif
+    #ifdef FILTER_IIR
+    d.filtered[c] = d.filtered[c] - (d.filtered[c] >> FILTER_SHIFT) + coilVal;
+    coilVal = d.filtered[c] >> FILTER_SHIFT;
+    #endif
+
+    // Update state machine as needed
+    switch (d.state[c]) {
+        case low: {
+            if (coilVal < (int16_t)d.resetLevel[c]) {
+                trackFloor(d, c, coilVal);
+            }
+            if (coilVal > (int16_t)d.triggerLevel[c]) {
+                d.edges++;
+                d.state[c] = rising;
+                d.peak[c] = coilVal;
+            }
+            break;
+        }
+        case rising: {
+            uint8_t next = d.levels | (1 << c);
+            d.risingTimestamp[c] = d.clock;
+            if (d.levels == 0) {
+                d.overlapped = false;
+            }
+            d.overlapped |= next == 0x03;
+            d.counts += (int8_t)pgm_read_byte(quadStep + (d.levels << 2 | next));
+            d.levels = next;
+            d.state[c] = rose;
+            break;
+        }
+        case rose:
+            if (coilVal > (int16_t)d.peak[c]) {
+                d.peak[c] = coilVal;
+            }
+            if (d.clock - d.risingTimestamp[c] > STUCK_HIGH_US) {
+                trackFloor(d, c, coilVal);
+            }
+            if (coilVal < (int16_t)d.resetLevel[c]) {
+                uint8_t next = d.levels & ~(1 << c);
+                int16_t diff = d.peak[c] - d.calPeak[c];
+                d.edges++;
+                d.counts += (int8_t)pgm_read_byte(quadStep + (d.levels << 2 | next));
+                d.levels = next;
+                if (d.levels == 0) {
+                    if (d.overlapped) {
+                        d.unpaired = NO_COIL;
+                    } else if (d.unpaired == (c ^ 1) && d.risingTimestamp[c] - d.risingTimestamp[c ^ 1] <= MAX_PULSE_SEP) {
+                        d.counts += c == COIL_A ? -COUNTS_PER_CYCLE : COUNTS_PER_CYCLE;
+                        d.unpaired = NO_COIL;
+                    } else {
+                        d.unpaired = c;
+                    }
+                }
+                d.state[c] = low;
+                d.lastPeak[c] = d.peak[c];
+                d.calPeak[c] += diff >> (diff < 0 ? CAL_PEAK_FALL : CAL_PEAK_RISE);
+            }
+            break;
+    }
+
+    // Report any whole steps, unless a lone pulse is under way
+    if ((d.overlapped || d.levels == 0) && (d.counts >= COUNTS_PER_STEP || d.counts <= -COUNTS_PER_STEP)) {
+        int8_t steps = d.counts / COUNTS_PER_STEP;
+        d.counts -= steps * COUNTS_PER_STEP;
+        return steps;
+    }
+    return 0;
+}
+
+// void levelsFor(uint16_t fl, uint16_t noise, uint16_t peak, uint16_t &trigger, uint16_t &reset) Work out
+// a coil's trigger and reset levels from its noise floor fl, its noise (calNoise, still << CAL_SHIFT) and its
+// typical pulse peak. The trigger level goes CAL_NOISE_MULT times the noise above the floor, but at least
+// CAL_MIN_MARGIN above it and, if the pulses are small, no more than half way up to the typical peak. (Though
+// never less than half what the noise calls for; it's the noise that's the problem if the pulses are that
+// small.) The reset level goes a third of the way back down, for hysteresis.
+void levelsFor(uint16_t fl, uint16_t noise, uint16_t peak, uint16_t &trigger, uint16_t &reset) {
+    uint16_t margin = (uint32_t)noise * CAL_NOISE_MULT >> CAL_SHIFT;
+    uint16_t ceiling = peak > fl ? (peak - fl) / 2 : 0;
+    if (margin > ceiling) {
+        margin = ceiling > margin / 2 ? ceiling : margin / 2;
+    }
+    if (margin < CAL_MIN_MARGIN) {
+        margin = CAL_MIN_MARGIN;
+    }
+    trigger = fl + margin < CAL_MAX_LEVEL ? fl + margin : CAL_MAX_LEVEL;
+    reset = trigger - margin / 3;
+}
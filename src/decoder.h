@@ -0,0 +1,93 @@
+/****
+ * JogWheel coil pulse decoder
+ *
+ * Turns the stream of samples of the two coils' induced voltages into wheel
+ * steps. This is the part of the ADC ISR that doesn't depend on the
+ * hardware: it knows nothing about the ADC, the timers or the ring the ISR
+ * puts steps in, so it can be replayed and benchmarked on a host (see
+ * bench/replay.cpp) as well as run on the jogwheel. How it works is
+ * described in decoder.cpp.
+ *
+ * Copyright (C) 2020 D.L. Ehnebuske
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ****/
+
+#ifndef DECODER_H
+#define DECODER_H
+#include <stdint.h>
+
+// Compile time constants
+#define FILTER_MEDIAN                   // Comment out to stop replacing each coil sample with the median of it and the two before
+//#define FILTER_IIR                      // Uncomment to low-pass filter the coil samples before the state machines see them
+#define FILTER_SHIFT        (2)         // With FILTER_IIR, each sample moves the filter output 1/2^FILTER_SHIFT of the way to it
+
+#define COIL_A              (0)         // Index value for coil A
+#define COIL_B              (1)         // Index value for coil B
+#define NO_COIL             (2)         // Index value meaning neither coil
+#define SAMPLE_US           (128)       // μs between samples. Coils alternate, so each is sampled every 2 * SAMPLE_US
+#define TRIGGER_A           (15)        // Rising trigger level for coil A until it's been calibrated
+#define TRIGGER_B           (15)        // Rising trigger level for coil B until it's been calibrated
+#define RESET_A             (10)        // Falling reset level for coil A until it's been calibrated
+#define RESET_B             (10)        // Falling reset level for coil B until it's been calibrated
+#define CAL_SHIFT           (6)         // Noise floor and noise averaged over 2^CAL_SHIFT samples
+#define CAL_PEAK_FALL       (1)         // Typical peak moves 1/2^CAL_PEAK_FALL of the way down to a smaller pulse's peak
+#define CAL_PEAK_RISE       (4)         // Typical peak moves 1/2^CAL_PEAK_RISE of the way up to a bigger pulse's peak
+#define CAL_NOISE_MULT      (6)         // Trigger level is this many times the noise above the noise floor...
+#define CAL_MIN_MARGIN      (8)         // ...but at least this much...
+#define CAL_MAX_LEVEL       (255)       // ...and no more than this (or half way up to the typical peak)
+#define MAX_PULSE_SEP       (40000)     // Maximum separation (μs) between A and B pulses that don't overlap we're sensitive to
+#define STUCK_HIGH_US       (250000)    // A coil high this long (μs) is taken to be resting above its reset level
+#define COUNTS_PER_CYCLE    (4)         // Quadrature counts (coil edges) per electrical cycle, i.e., per A and B pulse pair
+#define COUNTS_PER_STEP     (4)         // Counts per step reported. 4 ==> a step per A/B pulse pair; 2 or 1 is finer
+
+// Types
+enum coilState_t : uint8_t {low, rising, rose};                     // Coil state machine states
+struct coilDecoder {                                                // Everything the decoder knows about the coils
+    uint32_t clock;                                                 // μs since the decoder started, counting sampleUs per sample
+    uint16_t sampleUs;                                              // μs between samples (SAMPLE_US unless set from outside)
+    coilState_t state[2];                                           // State of each coil's state machine
+    uint32_t risingTimestamp[2];                                    // clock when each coil last entered state *rising*
+    uint8_t unpaired;                                               // Coil whose last lone pulse isn't part of a pair yet, if any
+    uint8_t levels;                                                 // Bit c set ==> coil c's machine isn't in state *low*
+    bool overlapped;                                                // Both coils have been high since levels was last 0
+    int8_t counts;                                                  // Quadrature counts not yet reported as steps
+    uint16_t peak[2];                                               // Peak value of the current pulse on each coil
+    uint16_t lastPeak[2];                                           // Peak value of the latest complete pulse on each coil
+    uint32_t edges;                                                 // Rising and falling coil edges seen
+    #ifdef FILTER_MEDIAN
+    int16_t prevVal[2][2];                                          // The two samples before this one on each coil
+    #endif
+    #ifdef FILTER_IIR
+    uint16_t filtered[2];                                           // Filter output on each coil << FILTER_SHIFT
+    #endif
+    volatile uint16_t triggerLevel[2];                              // Rising trigger level of each coil. Set from outside (calibration)
+    volatile uint16_t resetLevel[2];                                // Falling reset level of each coil. Set from outside (calibration)
+    volatile uint16_t calFloor[2];                                  // Noise floor of each coil << CAL_SHIFT
+    volatile uint16_t calNoise[2];                                  // Mean distance from the noise floor << CAL_SHIFT
+    volatile uint16_t calPeak[2];                                   // Typical peak of the smaller pulses on each coil
+};
+
+// Functions
+void initDecoder(coilDecoder &d);
+int8_t decodeSample(coilDecoder &d, uint8_t c, int16_t coilVal);
+void levelsFor(uint16_t fl, uint16_t noise, uint16_t peak, uint16_t &trigger, uint16_t &reset);
+
+#endif
@@ -0,0 +1,67 @@
+/****
+ * JogWheel action dispatch
+ *
+ * Copyright (C) 2020 D.L. Ehnebuske
+ *
+ * See decoder.h for the license.
+ *
+ ****/
+
+#include "dispatch.h"
+
+// uint16_t accelerate(uint16_t count, uint16_t interval, uint8_t level) Return the number of detents to act
+// on for count detents arriving interval μs apart at acceleration level level. At level n, once the detents
+// come faster than one every n * ACCEL_KNEE_US, count is multiplied by how many times faster, so the output
+// grows with the square of the wheel's speed. A saturated interval (ACCEL_NO_INTERVAL) is slower than any
+// knee, so it's never accelerated. The result is never more than MAX_BATCH.
+uint16_t accelerate(uint16_t count, uint16_t interval, uint8_t level) {
+    if (level == 0 || interval == 0 || interval == ACCEL_NO_INTERVAL) {
+        return count;
+    }
+    uint32_t answer = (uint32_t)count * level * ACCEL_KNEE_US / interval;
+    return answer < count ? count : answer > MAX_BATCH ? MAX_BATCH : answer;
+}
+
+// void startDetents(actionPlayer &pl, const actionPlan &p, int16_t nDetents, uint16_t interval) Get pl ready
+// to play p's sequence for the direction the wheel moved once per detent, for nDetents detents (cw > 0,
+// cc < 0, |nDetents| <= MAX_BATCH) the latest of which came interval μs after the one before. If the sequence
+// consists of nothing but mouse wheel rolls (plain or high-resolution) and mouse moves, it's played once,
+// scaling the amounts by the number of detents instead. If p has an acceleration level, the number of detents
+// acted on goes up when the wheel is spun quickly. Nothing is played until playSome() is called. p must stay
+// put until then.
+void startDetents(actionPlayer &pl, const actionPlan &p, int16_t nDetents, uint16_t interval) {
+    uint8_t dir = nDetents > 0 ? ENTRY_CW : ENTRY_CC;
+    uint16_t count = accelerate(nDetents > 0 ? nDetents : -nDetents, interval, p.accel);
+    pl.firstOp = p.op[dir];
+    pl.endOp = pl.firstOp + p.nOps[dir];
+    pl.nextOp = pl.firstOp;
+    pl.reps = p.nOps[dir] == 0 ? 0 : p.scalable[dir] ? 1 : count;
+    pl.scale = p.scalable[dir] ? count : 1;
+}
+
+// bool playSome(actionPlayer &pl, uint8_t maxOps) Play up to maxOps more of the actions pl was started on. 
+// Returns true if there are any left to play.
+bool playSome(actionPlayer &pl, uint8_t maxOps) {
+    while (pl.reps != 0 && maxOps-- != 0) {
+        playOp(pl.nextOp++, pl.scale);
+        if (pl.nextOp == pl.endOp) {
+            pl.nextOp = pl.firstOp;
+            pl.reps--;
+        }
+    }
+    return pl.reps != 0;
+}
+
+// void stopPlaying(actionPlayer &pl) Forget about whatever actions pl has left to play
+void stopPlaying(actionPlayer &pl) {
+    pl.reps = 0;
+}
+
+// void playDetents(const actionPlan &p, int16_t nDetents, uint16_t interval) Play all of p's actions for 
+// nDetents detents, as startDetents() describes, before returning
+void playDetents(const actionPlan &p, int16_t nDetents, uint16_t interval) {
+    actionPlayer pl;
+    startDetents(pl, p, nDetents, interval);
+    while (playSome(pl, 0xFF)) {
+    }
+}
@@ -0,0 +1,67 @@
+/****
+ * JogWheel action dispatch
+ *
+ * Plays the selected configuration's actions for the detents the wheel has
+ * turned. Like the decoder, this doesn't depend on the hardware: each
+ * action goes to playOp(), which whatever it's linked with supplies. On the
+ * jogwheel (main.cpp), playOp() sends HID reports; in the replay harness
+ * (bench/replay.cpp) it just counts them.
+ *
+ * Copyright (C) 2020 D.L. Ehnebuske
+ *
+ * See decoder.h for the license.
+ *
+ ****/
+
+#ifndef DISPATCH_H
+#define DISPATCH_H
+#include <stdint.h>
+
+// Compile time constants
+#define ENTRY_CW            (0)         // The clockwise sequence, e.g., in plan.op[x]
+#define ENTRY_CC            (1)         // The counterclockwise sequence, e.g., in plan.op[x]
+#define PLAN_MAX_OPS        (40)        // Max actions per direction in a configuration
+#define MAX_BATCH           (255)       // Max detents acted on at once. (Keeps scaled mouse amounts in int16_t range)
+#define ACCEL_KNEE_US       (7000)      // Detent interval (μs) below which acceleration level 1 starts to multiply detents
+#define ACCEL_MAX_LEVEL     (9)         // Highest acceleration level
+#define ACCEL_NO_INTERVAL   (0xFFFF)    // Detent interval meaning "this long or longer", e.g., the first after a pause
+
+// The intervals are uint16_t, saturating at ACCEL_NO_INTERVAL, so every level's knee has to be shorter than that
+static_assert((uint32_t)ACCEL_MAX_LEVEL * ACCEL_KNEE_US < ACCEL_NO_INTERVAL, "The highest level's knee must be < ACCEL_NO_INTERVAL");
+
+// Types
+enum opType_t : uint8_t {opKey, opWheel, opMove, opClick, opHiRes, opConsumer};  // Kinds of pre-decoded actions
+struct actionOp {                                                   // A configuration entry, decoded and ready to play
+    opType_t type;                                                  // What the action does
+    uint8_t mods;                                                   // Modifier keys held down, as in a keyboard report
+    uint8_t code;                                                   // opKey: key (in plan, HID usage); opMove, opClick: mouse buttons (MOUSE_*);
+                                                                    //   opConsumer: low 8 bits of the Consumer page usage
+    int8_t x;                                                       // opMove: x-distance; opWheel, opHiRes: wheel amount
+    int8_t y;                                                       // opMove: y-distance; opConsumer: the usage's high bits
+    uint8_t reps;                                                   // Times in a row the action is done: 1..CB_MAX_REPS
+};
+
+struct actionPlan {                                                 // A configuration, decoded and ready to play
+    uint8_t nOps[2];                                                // The number of actions for cw [ENTRY_CW] and cc [ENTRY_CC]
+    uint8_t accel;                                                  // The configuration's acceleration level
+    bool scalable[2];                                               // The sequence is nothing but wheel rolls (of either kind) and mouse moves
+    actionOp op[2][PLAN_MAX_OPS];                                   // The actions; a mouse move takes one, not two
+};
+
+struct actionPlayer {                                               // How far playing a plan's actions for some detents has got
+    const actionOp *firstOp;                                        // The first action of the sequence being played
+    const actionOp *endOp;                                          // Just past its last action
+    const actionOp *nextOp;                                         // The next action to play
+    uint16_t reps;                                                  // Times through the sequence still to go, counting this one
+    int16_t scale;                                                  // What the mouse amounts are multiplied by
+};
+
+// Functions
+uint16_t accelerate(uint16_t count, uint16_t interval, uint8_t level);
+void startDetents(actionPlayer &pl, const actionPlan &p, int16_t nDetents, uint16_t interval);
+bool playSome(actionPlayer &pl, uint8_t maxOps);
+void stopPlaying(actionPlayer &pl);
+void playDetents(const actionPlan &p, int16_t nDetents, uint16_t interval);
+void playOp(const actionOp *op, int16_t scale);                     // (Not here; supplied by whatever links with this)
+
+#endif
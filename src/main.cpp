@@ -30,9 +30,9 @@
  * directions and get many times bigger as you spin the shaft more quickly.)
  * 
  * The jogwheel plugs into a computer via USB where it appears as three 
- * devices, a keyboard, a mouse, and a serial port. To do this, it needs to 
- * run on an ATmega32U4.) Turning the wheel generates customizable keyboard and 
- * mouse events. More specifically, when you turn the wheel, the sketch 
+ * devices, a keyboard (with media keys), a mouse, and a serial port. To do 
+ * this, it needs to run on an ATmega32U4.) Turning the wheel generates 
+ * customizable keyboard and mouse events. More specifically, when you turn the wheel, the sketch 
  * generates repeating sequences of keystrokes and/or mouse events. It 
  * generates more repeats the more you turn the wheel. The keystrokes and/or 
  * mouse events that make up each sequence depends on two things. First 
@@ -46,6 +46,13 @@
  * Simultaneously clicking the right and middle buttons selects a fourth 
  * configuration, and so on. Each configuration is associated with a color. 
  * The color indicated by an LED tells which configuration you have selected.
+ * The LED also shows how fast you're turning the wheel, and blinks if you're 
+ * turning it faster than the jogwheel can send what it generates.
+ * 
+ * A jogwheel can also be built with two wheels (say, a coarse one 
+ * and a fine one), by setting WHEELS. Each wheel then has its own 
+ * configuration for each button combination, so the same button click can 
+ * make one wheel scroll and the other zoom.
  * 
  * Exactly what keystroke and/or mouse events make up each of the sequences 
  * for a configuration is up to you. You can set the sequences and define 
@@ -56,8 +63,10 @@
  * 1 start bit -- and type "help" to get started.
  * 
  * Keystrokes can include any printable character as well as many non-printing 
- * keystrokes like "up-arrow" and "down-arrow". Mouse events can include mouse 
- * movement, button clicks, and wheel movements. In addition, the keystrokes 
+ * keystrokes like "up-arrow" and "down-arrow", and media keys like "volume 
+ * up" and "play/pause". Mouse events can include mouse movement, button 
+ * clicks, and wheel movements, including high-resolution ones, a fraction 
+ * of a wheel click at a time, for hosts that support them. In addition, the keystrokes 
  * and mouse movements can include modifier keys like ctrl, alt, shift and 
  * "gui". The "gui" modifier is os-dependent. On Mac-OS it's called "option" 
  * on Windows it's called the "Windows key". Various Linux systems also have a 
@@ -89,12 +98,18 @@
 
 #include <Arduino.h>
 #ifdef __AVR_ATmega32U4__
+#include <HID.h>                            // Send HID reports
 #include <Keyboard.h>
 #include <Mouse.h>
 #endif
 #include <avr/eeprom.h>                     // Store and retrieve values in non-volatile eeprom
+#include <avr/sleep.h>                      // Sleep the CPU while the wheel is idle
 #include <util/atomic.h>                    // Atomic blocks
+#include <util/crc16.h>                     // CRCs for the binary protocol
 #include "UserInput.h"
+#include "decoder.h"                        // Coil pulse decoder (and its compile time constants)
+#include "dispatch.h"                       // Action plans and playing them (and their compile time constants)
+#include "pins.h"                           // Compile-time pin to port mapping
 
 /****
  * 
@@ -107,11 +122,21 @@
 //#define DEBUG_PARSE                     // Uncomment to enable config spec parsing debugging
 //#define DEBUG                           // Uncomment to enable general debugging output
 //#define FACTORY_RESET                   // Uncomment to "factory reset," i.e., reinitialize EEPROM
+//#define MERGE_WHEEL                     // Uncomment to merge consecutive wheel rolls with the same modifiers into one
+//#define BENCH_LATENCY                   // Uncomment (or build env:leonardo_bench) to measure detent to HID report latency
 #define D_STATE_SIZE        (16)        // Number of ISR states to record for debugging
+#define STATS_SHIFT         (4)         // Each ISR run moves isrStats.avgTicks 1/2^STATS_SHIFT of the way to its run time
+#define STACK_PAINT         (0xC5)      // What paintStack() fills the free RAM with at reset
+#define RAM_RESERVE         (512)       // RAM the big buffers have to leave for the core, the other variables and the stack
+#define LAT_BINS            (14)        // Bins in a latency histogram (BENCH_LATENCY)
 
 // Hardware GPIO pin definitions
-#define COIL_A_PIN          (A0)        // A+ goes here. (A- goes to GND.)
-#define COIL_B_PIN          (A1)        // B+ goes here. (B- goes to GND.)
+#define WHEELS              (1)         // Number of wheels (two-coil stepper motors) attached: 1..MAX_WHEELS
+#define MAX_WHEELS          (2)         // Most wheels there's room for (in RAM for plan[], and in a BIN_WRITE_HEADER)
+#define COIL_A_PIN          (A0)        // Wheel 0's A+ goes here. (A- goes to GND.)
+#define COIL_B_PIN          (A1)        // Wheel 0's B+ goes here. (B- goes to GND.)
+#define COIL_A1_PIN         (A2)        // Wheel 1's A+, if there's a wheel 1
+#define COIL_B1_PIN         (A3)        // Wheel 1's B+
 #define LED_R               (8)         // Where we attached the red part of the LED
 #define LED_G               (7)         // Where we attached the green part of the LED
 #define LED_B               (6)         // Where we attached the blue part of the LED
@@ -120,11 +145,32 @@
 #define BUTTON_C            (5)         // Configuration selector switch C attaches here
 
 // EEPROM related stuff
-#define FINGERPRINT         (0xC29D)    // EEPROM "fingerprint" value for JogWheel
-#define ENTRY_CW            (0)         // The clockwise entry in a config.entry[x] pair
-#define ENTRY_CC            (1)         // The counterclockwise entry in a confiog.entry[x] pair
+#define FINGERPRINT         (0xC2A2 + WHEELS - 1)   // EEPROM "fingerprint" value for JogWheel (the header's size depends on WHEELS)
+#define EE_QUEUE_SIZE       (8)         // Number of pending asynchronous EEPROM writes. Must be a power of 2
+#define SEL_SLOTS           (16)        // Number of wear-leveling slots for the selected button combo
+#define SEL_SLOT_ADDR       (E2END + 1 - SEL_SLOTS) // EEPROM address of the first selection slot (end of EEPROM)
+#define SEL_PHASE_MASK      (0x80)      // Selection slot bit that flips each time around the slots
+#define SEL_VALUE_MASK      (0x07)      // Selection slot bits holding the selected button combo
 #define N_ELEMENTS(a)       ((uint16_t)(sizeof(a) / sizeof(a[0]))) // Number of elements in an array
 
+// Config block encoding. (See "EEPROM Usage.txt")
+#define CB_MAX_SIZE         (255)       // Max bytes in a CB (header.configSize[] is a uint8_t)
+#define CB_MIRRORED         (0x01)      // In CB flags byte, =1 ==> cc is cw with amounts negated; only cw is stored
+#define CB_KEY              (0x80)      // Key code >= 0x80 follows. (A byte < 0x80 is an ASCII key itself.)
+#define CB_REPEAT           (0x80)      // | (reps - 1), if that's not 0: the direction's next action is done reps times
+#define CB_REPEAT_MASK      (0xF0)      // Bits that say a byte is CB_REPEAT (if the rest aren't 0)
+#define CB_MAX_REPS         (16)        // Most times an action can be repeated
+#define CB_MODS             (0x90)      // | casg modifiers held for the direction's following actions
+#define CB_CLICK            (0xA0)      // | buttons (MOUSE_*) to click
+#define CB_WHEEL            (0xA8)      // Signed wheel amount follows
+#define CB_HIRES            (0xA9)      // Signed high-resolution wheel amount follows. (CB_WHEEL's op bits, arg 1)
+#define CB_MOVE             (0xB0)      // | buttons (MOUSE_*) held; signed x and y distances follow
+#define CB_CONSUMER         (0xB8)      // | Consumer page usage bits 8..10; the usage's low 8 bits follow
+#define CB_MAX_USAGE        (0x7FF)     // Highest Consumer page usage a CB can hold
+#define CB_OP_MASK          (0xF8)      // Bits that say which of the above a byte is
+#define CB_MODS_MASK        (0xF0)      // Bits that say a byte is CB_MODS
+#define CB_ARG_MASK         (0x07)      // The buttons in a CB_CLICK or CB_MOVE
+
 // Configuration entry bits and masks
 #define CE_TYPE_MASK        (0x8000)    // =0 ==> keyboard entry, =1 ==> Mouse entry
 #define KB_CTRL_MASK        (0x0800)    // =1 ==> ctrl-key down in keyboard entry
@@ -151,46 +197,94 @@
 #define ME3_RIGHT_MASK      (0x2)       // =1 ==> Right mouse button clicked
 #define ME3_MID_MASK        (0x4)       // =1 ==> Middle mouse button clicked
 
+// Binary configuration protocol. (See "Binary Protocol.txt")
+#define BIN_SYNC            (0xA5)      // First byte of every frame
+#define BIN_MAX_PAYLOAD     (64)        // Max bytes of payload in a request
+#define BIN_MAX_DATA        (BIN_MAX_PAYLOAD - 2) // Max bytes of EEPROM data in a read or write request
+#define BIN_TIMEOUT_MILLIS  (100)       // Max millis() between bytes of a request
+#define BIN_INFO            (0x01)      // Request: fingerprint, EEPROM size, header size
+#define BIN_READ_HEADER     (0x02)      // Request: the header
+#define BIN_WRITE_HEADER    (0x03)      // Request: replace the header (after checking it)
+#define BIN_READ_EEPROM     (0x04)      // Request: up to BIN_MAX_DATA bytes from EEPROM
+#define BIN_WRITE_EEPROM    (0x05)      // Request: write up to BIN_MAX_DATA bytes to EEPROM
+#define BIN_RELOAD          (0x06)      // Request: reread the header and configuration from EEPROM
+#define BIN_EXIT            (0x07)      // Request: go back to the command line
+#define BIN_SELECT          (0x08)      // Request: select a button combo, without saving it in EEPROM
+#define BIN_LOAD_PLAN       (0x09)      // Request: play a CB sent with the request on a wheel, without saving it in EEPROM
+#define BIN_OK              (0x00)      // Response status: done
+#define BIN_BAD_CMD         (0x01)      // Response status: no such request
+#define BIN_BAD_LENGTH      (0x02)      // Response status: payload the wrong size or EEPROM address out of range
+#define BIN_BAD_CRC         (0x03)      // Response status: the request's CRC was wrong
+#define BIN_BAD_HEADER      (0x04)      // Response status: the header or a CB it points to doesn't make sense
+
+// Capture mode (see "Capture Stream.txt")
+#define CAP_SYNC            (0x5AA5)    // First two bytes of every block (a5, 5a)
+#define CAP_SAMPLES         (64)        // Samples per block. Each of the two blocks fills in CAP_SAMPLES * SAMPLE_US μs
+#define CAP_COIL_B          (0x8000)    // Set in a sample if it's from coil B. (The ADC value is in the low 10 bits)
+#define CAP_WHEEL_SHIFT     (12)        // A sample's wheel is in bits 12 and 13
+
+// HID reports (as laid out by the Keyboard and Mouse libraries' HID descriptors, and by hidDescriptor[])
+#define HID_MOUSE_ID        (1)         // Report ID of mouse reports: buttons, x, y, wheel
+#define HID_KEYBOARD_ID     (2)         // Report ID of keyboard reports: modifiers, reserved, keys[6]
+#define HID_CONSUMER_ID     (3)         // Report ID of consumer control reports: usage (16 bits, 0 ==> none)
+#define HID_HIRES_ID        (4)         // Report ID of high-resolution wheel reports: x, y (both always 0), wheel (16 bits)
+#define HID_HIRES_CLICK     (120)       // High-resolution wheel units per wheel click (the Resolution Multiplier)
+#define HID_MAX_REPORT      (8)         // Longest report we send (a keyboard report)
+#define REPORT_QUEUE_SIZE   (16)        // Number of HID reports that can wait to be sent. Must be a power of 2
+#define REPORT_LOW_WATER    (4)         // wheelTask() plays more actions only while no more reports than this are waiting
+#define REPORT_STALL_MILLIS (3)         // millis() without a new USB frame after which the next report is sent anyway
+#define HID_SHIFT           (0x80)      // In hidUsage[], =1 ==> shift-key needed to type the character
+#define HID_MOD_SHIFT       (0x02)      // Shift-key bit in a keyboard report's modifiers
+
 // Misc.
-#define COIL_A              (0)         // Index value for global vars for coil A
-#define COIL_B              (1)         // Index value for global vars for coil B
-#define TRIGGER_A           (15)        // Rising trigger level for coil A
-#define TRIGGER_B           (15)        // Rising trigger level for coil B
-#define TRIGGER(c)          ((c) == 0 ? TRIGGER_A : TRIGGER_B)
-#define RESET_A             (10)        // Falling reset level for coil A
-#define RESET_B             (10)        // Falling reset level for coil B
-#define RESET(c)            ((c) == 0 ? RESET_A : RESET_B)
-#define MAX_PULSE_SEP       (40000)     // Maximum separation (μs) between A and B pulses we're sensitive to
+#define EVENT_RING_SIZE     (16)        // Number of wheelEvents the ISR can queue for loop(). Must be a power of 2
+#define BUTTON_RING_SIZE    (8)         // Number of buttonEvents the ISR can queue for loop(). Must be a power of 2
+#define BUTTON_EVERY        (4)         // Samples between the ISR's looks at the buttons (512μs at full speed)
+#define CAL_MILLIS          (100)       // millis() between recalculations of the trigger and reset levels
+#define CAL_WARMUP_MILLIS   (1000)      // millis() after startup before the first recalculation
+#define CAL_SAVE_DELTA      (2)         // How much a level must have changed for it to be worth saving in EEPROM
+#define CAL_SAVE_MILLIS     (600000UL)  // Min millis() between saves of the levels in EEPROM
+#define IDLE_MILLIS         (30000UL)   // millis() without coil edges or buttons down before we go idle
+#define IDLE_SLOWDOWN       (4)         // While idle, samples are taken this many times less often (every 512μs)
+#define PLAY_SLICE          (4)         // Max actions wheelTask() plays before the other tasks get a turn
+#define PRINT_SLICE         (64)        // Max characters printYielding() prints before wheelTask() gets a turn
+#define CLI_WORD_SIZE       (24)        // Longest command line word we look at, plus 1
 #define DEBOUNCE_MILLIS     (10)        // millis() that must pass for us to believe a button has changed state
 #define FINGER_MILLIS       (150)       // How long a button chord must persist for us to believe it
+#define LED_MILLIS          (32)        // millis() between ledTask()'s updates of the LED
+#define LED_FULL_RATE       (100)       // Detents per second the wheel must turn for the LED to show full activity
+#define LED_WARN_MILLIS     (2000)      // How long the LED keeps blinking after eventRing was last full
+#define LED_BLINK_MILLIS    (125)       // How long each half of the warning blink lasts
+#define LED_BLUE            (0x04)      // The blue part's bit in an LED color (as in ledPins)
 #define BANNER              (F("JogWheel v1.0"))
 
-// Processor dependencies -- ATmega328P and ATmega32U4 supported
-#if defined(__AVR_ATmega32U4__)
-    #define TIMERx_COMPA_vect   TIMER3_COMPA_vect
-    #define TCCRxA              TCCR3A
-    #define TCCRxB              TCCR3B
-    #define OCRxA               OCR3A
-    #define OCIExA              OCIE3A
-    #define WGMx1               WGM31
-    #define CSx0                CS30
-    #define CSx1                CS31
-    #define TIMSKx              TIMSK3
-#elif defined(__AVR_ATmega328P__)
+#define SAMPLE_TICKS        ((uint16_t)(F_CPU / 8 / 1000000UL * SAMPLE_US)) // Timer 1 (clk/8) ticks per ADC conversion
+#define ADC_CONVERSION_US   (108)       // An auto-triggered conversion: 13.5 ADC clocks at F_CPU / 128 (125kHz)
+
+// Processor dependencies -- ATmega328P and ATmega32U4 supported. Both use Timer 1 compare match B to 
+// auto-trigger the ADC; only the keyboard definitions, the pin mapping (in pins.h) and the timer that does 
+// the LED's PWM differ.
+#if defined(__AVR_ATmega328P__)
+    #define LED_PWM_OCR         (OCR0A)     // Pin 6 is Timer 0's output compare A (Timer 0 also runs millis())
+    #define LED_PWM_TCCR        (TCCR0A)
+    #define LED_PWM_COM         (_BV(COM0A1))   // COM0A[1:0] = 0x2 i.e., clear on compare match, non-inverting
     #define KEY_UP_ARROW        (0xDA)
     #define KEY_DOWN_ARROW      (0xD9)
-    #define TIMERx_COMPA_vect   TIMER2_COMPA_vect
-    #define TCCRxA              TCCR2A
-    #define TCCRxB              TCCR2B
-    #define OCRxA               OCR2A
-    #define OCIExA              OCIE2A
-    #define WGMx1               WGM21
-    #define CSx0                CS20
-    #define CSx1                CS21
-    #define TIMSKx              TIMSK2
+    #define MOUSE_LEFT          (1)
+    #define MOUSE_RIGHT         (2)
+    #define MOUSE_MIDDLE        (4)
+#elif defined(__AVR_ATmega32U4__)
+    #define LED_PWM_OCR         (OCR4D)     // Pin 6 is Timer 4's output compare D
+    #define LED_PWM_TCCR        (TCCR4C)
+    #define LED_PWM_COM         (_BV(COM4D1))   // COM4D[1:0] = 0x2 i.e., clear on compare match, non-inverting
 #else
     #warning Unsupported processor!
 #endif
+static_assert(ADC_CONVERSION_US < SAMPLE_US, "Each conversion must be done before Timer 1 triggers the next");
+static_assert(LED_B == 6, "The LED's blue part must be on pin 6, the only LED pin with PWM (not on Timer 1)");
+#if defined(BENCH_LATENCY) && !defined(__AVR_ATmega32U4__)
+    #error The latency benchmark needs Timer 3, which only the ATmega32U4 has
+#endif
 
 /****
  * 
@@ -199,110 +293,561 @@
  ****/
 
 // Types
-enum movement_t : byte {cw, none, cc};                              // Shaft movement
-enum coilState_t : byte {low, rising, rose};                        // Timer 2 interrupt state machine states
+struct wheelEvent {                                                 // What the ISR tells loop() about a detent
+    uint8_t wheel;                                                  // Which wheel turned
+    int8_t steps;                                                   // Steps (COUNTS_PER_STEP counts) turned (cw > 0, cc < 0). Normally 1 or -1
+    uint16_t interval;                                              // μs since the previous detent (max ACCEL_NO_INTERVAL)
+    unsigned long timestamp;                                        // micros() when the detent was detected
+    #ifdef BENCH_LATENCY
+    uint32_t cycles;                                                // benchCycles() when the detent was detected
+    #endif
+    uint16_t peak[2];                                               // Peak value of the latest complete pulse on each coil
+};
+struct buttonEvent {                                                // What the ISR tells loop() about the buttons changing
+    uint8_t buttons;                                                // Which buttons are now down: bit 0 is A, 1 is B, 2 is C
+    unsigned long timestamp;                                        // millis() when the change was seen
+};
+struct isrCounters {                                                // What the ISR counts, for the stats command
+    uint32_t samples;                                               // ADC conversions handled
+    uint32_t steps;                                                 // Steps put in eventRing (either direction)
+    uint16_t ringFull;                                              // Times steps had to wait for room in eventRing
+    uint16_t minTicks;                                              // Shortest ISR run time, in Timer 1 ticks
+    uint16_t maxTicks;                                              // Longest ISR run time, in Timer 1 ticks
+    uint16_t avgTicks;                                              // Moving average ISR run time, in Timer 1 ticks << STATS_SHIFT
+};
+struct captureBlock {                                               // A block of raw samples, as sent in capture mode
+    uint16_t sync;                                                  // CAP_SYNC
+    uint8_t seq;                                                    // Block sequence number, counting from 0 at the start of the capture
+    uint8_t count;                                                  // Number of samples (CAP_SAMPLES)
+    uint16_t dropped;                                               // Samples dropped since the previous block (max 0xFFFF)
+    uint32_t timestamp;                                             // micros() at the first sample. Each one after is SAMPLE_US μs later
+    uint16_t sample[CAP_SAMPLES];                                   // The samples: ADC value | (CAP_COIL_B if coil B)
+};
+struct hidReport {                                                  // A HID report waiting to be sent
+    uint8_t id;                                                     // Its report ID (HID_*_ID)
+    uint8_t len;                                                    // How many bytes of data there are
+    uint8_t data[HID_MAX_REPORT];                                   // The report itself
+};
+#ifdef BENCH_LATENCY
+struct latencyHist {                                                // A histogram of latencies
+    uint16_t count[LAT_BINS];                                       // Latencies in each bin (max 0xFFFF)
+    uint32_t maxCycles;                                             // Longest latency seen, in CPU cycles
+};
+#endif
 struct headerBlock {                                                // The configuration header (from EEPROM)
     uint16_t fingerprint;                                           // Fingerprint to say this is ours
-    uint8_t selection;                                              // The configuration selected (index into curconfig): 0..7
-    uint8_t curConfig[7];                                           // Which configuration corresponds with which combo of button pushes
+    uint8_t curConfig[WHEELS][7];                                   // Which configuration each wheel uses for which combo of button pushes
     uint16_t configPtr[8];                                          // Addresses in EEPROM of start of each configuraton 
+    uint8_t configSize[8];                                          // Size in EEPROM of each configuration
+    uint8_t accel[8];                                               // Acceleration level of each configuration: 0 (none)..ACCEL_MAX_LEVEL
+    uint8_t trigger[WHEELS][2];                                     // Calibrated rising trigger level of each wheel's coils
+    uint8_t reset[WHEELS][2];                                       // Calibrated falling reset level of each wheel's coils
+};
+
+struct eeWrite {                                                    // An asynchronous EEPROM write: bring EEPROM up to date with RAM
+    uint16_t addr;                                                  // Where in EEPROM the next byte goes
+    const uint8_t *src;                                             // Where in RAM it comes from
+    uint8_t len;                                                    // How many bytes are left to do
+    uint8_t value;                                                  // The byte, if it's a one-byte write (src then points here)
+};
+
+struct cbWriter {                                                   // Encodes a configuration as a CB in EEPROM
+    uint16_t addr;                                                  // Where the next byte goes. 0 ==> nowhere; just measure
+    uint8_t nPairs;                                                 // cw/cc pairs of actions put so far
+    uint16_t len[2];                                                // Bytes of cw [ENTRY_CW] and cc [ENTRY_CC] actions put so far
+    uint8_t mods[2];                                                // Modifiers in effect for each direction
+    bool mirrored;                                                  // Every cc action is its cw one mirrored (so, if writing, skip them)
 };
 
-struct configBlock {                                                // The shape of a configuration
-    uint8_t nEntries;                                               // The number of entries in this configuration block 0..31
-    uint16_t entry[32][2];                                          // Space for the max number of entries entry[?][0] is action for cw, [1] is cc
+struct cbReader {                                                   // Decodes a CB in EEPROM (or RAM), one cw/cc pair of actions at a time
+    const uint8_t *ram;                                             // The CB, if it's in RAM, in which case addr and end are offsets into it
+    uint16_t addr;                                                  // Where the next byte comes from
+    uint16_t end;                                                   // Where the CB ends
+    uint8_t mods[2];                                                // Modifiers in effect for each direction
+    bool mirrored;                                                  // Only cw is stored; cc is its mirror
+    bool bad;                                                       // Ran into something that isn't a valid action
 };
+typedef bool (*cbSource)(cbWriter &w);                              // Puts a configuration's actions in a CB, the same ones each call
 // Variables
-const byte coilPin[2] = {COIL_A_PIN, COIL_B_PIN};                   // Coil index to pin map
-const char* ledColor[7] = {"red    ", "green  ", "yellow ", "blue   ", 
-                           "magenta", "cyan   ", "white  "};        // LED colors corresponding to header.selection
+extern "C" char __heap_start;                                       // (From the linker) The end of .data + .bss; where the heap starts
+extern "C" char *__brkval;                                          // (From malloc()) The top of the heap; 0 if nothing's been malloc()ed yet
+static_assert(WHEELS >= 1 && WHEELS <= MAX_WHEELS, "WHEELS must be 1..MAX_WHEELS");
+static_assert(pinAdcChannel(COIL_A_PIN) < 8 && pinAdcChannel(COIL_B_PIN) < 8 && pinAdcChannel(COIL_A1_PIN) < 8 &&
+    pinAdcChannel(COIL_B1_PIN) < 8,
+    "Coils must be on ADC channels 0..7");
+const byte coilMux[2 * WHEELS] = {                                  // Channel (wheel * 2 + coil) to ADMUX value map: AVcc
+    _BV(REFS0) | pinAdcChannel(COIL_A_PIN), _BV(REFS0) | pinAdcChannel(COIL_B_PIN)     // reference, as analogRead(). (We
+    #if WHEELS > 1                                                                      // don't touch MUX5)
+    , _BV(REFS0) | pinAdcChannel(COIL_A1_PIN), _BV(REFS0) | pinAdcChannel(COIL_B1_PIN)
+    #endif
+};
+typedef pinGroup<LED_R, LED_G, LED_B> ledPins;                      // The LED: bit 0 red, 1 green, 2 blue
+typedef pinGroup<BUTTON_A, BUTTON_B, BUTTON_C> buttonPins;          // The buttons: bit 0 A, 1 B, 2 C. Low when down
+const char ledColor[7][8] PROGMEM = {"red    ", "green  ", "yellow ", "blue   ", 
+                                   "magenta", "cyan   ", "white  "};// LED colors corresponding to selection
+const uint8_t hidUsage[128] PROGMEM = {                             // ASCII to HID usage (and HID_SHIFT) map, US layout
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x2A, 0x2B, 0x28, 0x00, 0x00, 0x00, 0x00, 0x00,   // 0x00..0x0F
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // 0x10..0x1F
+    0x2C, 0x9E, 0xB4, 0xA0, 0xA1, 0xA2, 0xA4, 0x34, 0xA6, 0xA7, 0xA5, 0xAE, 0x36, 0x2D, 0x37, 0x38,   // 0x20..0x2F
+    0x27, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0xB3, 0x33, 0xB6, 0x2E, 0xB7, 0xB8,   // 0x30..0x3F
+    0x9F, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8A, 0x8B, 0x8C, 0x8D, 0x8E, 0x8F, 0x90, 0x91, 0x92,   // 0x40..0x4F
+    0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0x9B, 0x9C, 0x9D, 0x2F, 0x31, 0x30, 0xA3, 0xAD,   // 0x50..0x5F
+    0x35, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x11, 0x12,   // 0x60..0x6F
+    0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0xAF, 0xB1, 0xB0, 0xB5, 0x00   // 0x70..0x7F
+};
+#ifdef __AVR_ATmega32U4__
+const uint8_t hidDescriptor[] PROGMEM = {                           // Our part of the HID report descriptor (see hidExtras)
+    0x05, 0x0C,                                                     // Usage page (Consumer)
+    0x09, 0x01,                                                     // Usage (Consumer Control)
+    0xA1, 0x01,                                                     // Collection (Application)
+    0x85, HID_CONSUMER_ID,                                          //   Report ID
+    0x15, 0x00,                                                     //   Logical minimum (0)
+    0x26, CB_MAX_USAGE & 0xFF, CB_MAX_USAGE >> 8,                   //   Logical maximum (CB_MAX_USAGE)
+    0x19, 0x00,                                                     //   Usage minimum (0, i.e., none)
+    0x2A, CB_MAX_USAGE & 0xFF, CB_MAX_USAGE >> 8,                   //   Usage maximum (CB_MAX_USAGE)
+    0x75, 0x10,                                                     //   Report size (16)
+    0x95, 0x01,                                                     //   Report count (1)
+    0x81, 0x00,                                                     //   Input (Data, Array, Absolute): the usage that's down
+    0xC0,                                                           // End collection
+    0x05, 0x01,                                                     // Usage page (Generic Desktop)
+    0x09, 0x02,                                                     // Usage (Mouse)
+    0xA1, 0x01,                                                     // Collection (Application)
+    0x85, HID_HIRES_ID,                                             //   Report ID
+    0x09, 0x01,                                                     //   Usage (Pointer)
+    0xA1, 0x00,                                                     //   Collection (Physical)
+    0x09, 0x30,                                                     //     Usage (X)
+    0x09, 0x31,                                                     //     Usage (Y)
+    0x15, 0x81,                                                     //     Logical minimum (-127)
+    0x25, 0x7F,                                                     //     Logical maximum (127)
+    0x75, 0x08,                                                     //     Report size (8)
+    0x95, 0x02,                                                     //     Report count (2)
+    0x81, 0x06,                                                     //     Input (Data, Variable, Relative)
+    0xA1, 0x02,                                                     //     Collection (Logical)
+    0x09, 0x48,                                                     //       Usage (Resolution Multiplier)
+    0x15, 0x00,                                                     //       Logical minimum (0)
+    0x25, 0x01,                                                     //       Logical maximum (1)
+    0x35, 0x01,                                                     //       Physical minimum (1)
+    0x45, HID_HIRES_CLICK,                                          //       Physical maximum (HID_HIRES_CLICK)
+    0x75, 0x08,                                                     //       Report size (8)
+    0x95, 0x01,                                                     //       Report count (1)
+    0xB1, 0x02,                                                     //       Feature (Data, Variable, Absolute)
+    0x35, 0x00,                                                     //       Physical minimum (0)
+    0x45, 0x00,                                                     //       Physical maximum (0, i.e., as logical)
+    0x09, 0x38,                                                     //       Usage (Wheel)
+    0x16, 0x01, 0x80,                                               //       Logical minimum (-32767)
+    0x26, 0xFF, 0x7F,                                               //       Logical maximum (32767)
+    0x75, 0x10,                                                     //       Report size (16)
+    0x95, 0x01,                                                     //       Report count (1)
+    0x81, 0x06,                                                     //       Input (Data, Variable, Relative)
+    0xC0,                                                           //     End collection
+    0xC0,                                                           //   End collection
+    0xC0                                                            // End collection
+};
+
+// Adds hidDescriptor[] to the HID report descriptor, the way the Keyboard and Mouse libraries add theirs. 
+// It has to be done by a constructor: by the time setup() runs, the host may already have asked for it.
+struct hidExtra {
+    hidExtra() {
+        static HIDSubDescriptor node(hidDescriptor, sizeof(hidDescriptor));
+        HID().AppendDescriptor(&node);
+    }
+} hidExtras;
+#endif
 UserInput ui {Serial};                                              // Our user input object from library UserInput
-movement_t movement = {none};                                       // What sort of movement was detected (if any)
-                                                                    // Set to cc or cw by ISR, reset to none by loop()
+wheelEvent eventRing[EVENT_RING_SIZE];                              // Detents not yet acted on, oldest at eventTail
+volatile uint8_t eventHead = 0;                                     // Where the ISR puts the next event. Only the ISR changes it
+volatile uint8_t eventTail = 0;                                     // Where loop() gets the next event. Only loop() changes it
+buttonEvent buttonRing[BUTTON_RING_SIZE];                           // Button changes not yet looked at, oldest at buttonTail
+volatile uint8_t buttonHead = 0;                                    // Where the ISR puts the next button change. Only the ISR changes it
+volatile uint8_t buttonTail = 0;                                    // Where loop() gets the next button change. Only loop() changes it
 headerBlock header;                                                 // Copy of header from EEPROM
+headerBlock eeHeader;                                               // What writeHeader() has queued to be written to EEPROM
+uint8_t selection;                                                  // The selected button combo (index into header.curConfig[w]): 0..6
+uint8_t selSlot;                                                    // The selection slot holding selection
+uint8_t selSlotValue;                                               // What's in (or on its way to) that slot
+eeWrite eeQueue[EE_QUEUE_SIZE];                                     // Asynchronous EEPROM writes. Oldest at eeTail
+volatile uint8_t eeHead = 0;                                        // Where the next write gets queued. Only loop() changes it
+volatile uint8_t eeTail = 0;                                        // The write under way. Only EE_READY ISR changes it
+uint8_t eeHolds = 0;                                                // eeHold()s not yet eeRelease()d. Queued writes wait while > 0
+actionPlan plan[WHEELS];                                            // Each wheel's selected configuration, decoded from EEPROM
+actionPlayer player;                                                // How far wheelTask() has got playing a plan's actions
+bool buttonsDown = false;                                           // Some button is down, as of the last buttonTask()
+uint8_t ledShown = 0;                                               // The color the LED is showing, before ledTask() adds the activity
+uint8_t ledActivity = 0;                                            // How fast the wheel's turning: 0..255 (LED_FULL_RATE detents/s)
+bool ledWarning = false;                                            // The LED is blinking because eventRing was full
+bool binaryMode = false;                                            // The serial port is using the binary protocol, not ui
+volatile bool capturing = false;                                    // The serial port is streaming raw samples, not using ui
+volatile bool idleWanted = false;                                   // loop() wants sampling slowed down. The ISR clears it on an edge
+volatile bool sampleSlow = false;                                   // Sampling is slowed down (by IDLE_SLOWDOWN). Only the ISR changes it
+captureBlock capBlock[2];                                           // The capture blocks: one filling while the other is sent
+volatile bool capFull[2] = {false, false};                          // Block is waiting to be sent. Set by the ISR, cleared by captureRun()
+volatile uint8_t capFill = 0;                                       // The block the ISR is filling. Only the ISR changes it, once capturing
+uint8_t capIx;                                                      // Where the ISR puts the next sample in capBlock[capFill]
+uint8_t capSeq;                                                     // Sequence number of the next block the ISR starts
+uint16_t capDropped;                                                // Samples the ISR has dropped since the last block it started
+uint8_t capSend;                                                    // The block captureRun() sends next
+coilDecoder dec[WHEELS];                                            // Each wheel's coil pulse decoder. The ISR runs them; calibrate() sets their levels
+volatile isrCounters isrStats = {0, 0, 0, 0xFFFF, 0, 0};            // The ISR's counters. Only the ISR and onStats() change them
+uint32_t hidReports = 0;                                            // HID reports sent since the counters were reset
+uint32_t hidFailures = 0;                                           // HID reports that couldn't be sent (e.g., USB not configured)
+#ifdef __AVR_ATmega32U4__
+hidReport reportQueue[REPORT_QUEUE_SIZE];                           // HID reports waiting to be sent, oldest at reportTail
+uint8_t reportHead = 0;                                             // Where queueReport() puts the next report
+uint8_t reportTail = 0;                                             // The report paceReports() sends next
+uint8_t reportMostQueued = 0;                                       // Most reports there have been waiting since the counters were reset
+uint16_t reportWaits = 0;                                           // Times a report had to wait for room in reportQueue
+#endif
+unsigned long statsMillis = 0;                                      // millis() when the counters were last reset
+uint32_t statsEdges = 0;                                            // allEdges() when the counters were last reset
+static_assert(sizeof(headerBlock) <= BIN_MAX_PAYLOAD, "The header must fit in one BIN_WRITE_HEADER request");
+static_assert(sizeof(plan) + sizeof(dec) + sizeof(header) + sizeof(eeHeader) + sizeof(eventRing) + sizeof(buttonRing) + sizeof(eeQueue) +
+    sizeof(capBlock)
+    #ifdef __AVR_ATmega32U4__
+    + sizeof(reportQueue)
+    #endif
+    <= RAMEND + 1 - RAMSTART - RAM_RESERVE, "Too little RAM left for the stack; use fewer WHEELS");
 
 #ifdef DEBUG_ISR
 byte dStateIx = 0;                                                  // How many states recorded
 coilState_t dState[D_STATE_SIZE][2];                                // The states recorded for debugging
-int dCoilVal[D_STATE_SIZE][2];                                      // coilVal[] at each recorded state
+byte dCoil[D_STATE_SIZE];                                           // The channel (wheel * 2 + coil) sampled at each recorded state
+int dCoilVal[D_STATE_SIZE];                                         // The sampled coil's value at each recorded state
 unsigned long dRisingTimestamp[D_STATE_SIZE][2];                    // risingTimestamp at entry to state *rising*
-movement_t dMovement[D_STATE_SIZE];                                 // movement at each recorded state
+uint8_t dQueued[D_STATE_SIZE];                                      // Number of queued events at each recorded state
+#endif
+
+#ifdef BENCH_LATENCY
+volatile uint16_t benchHigh = 0;                                    // Timer 3 overflows since setup()
+uint32_t benchDetected;                                             // wheelEvent.cycles of the oldest of the detents being played
+uint32_t benchLastReport;                                           // benchCycles() when the last report was sent (or at pickup)
+bool benchFirstSent;                                                // The first report for the detents being played has been sent
+latencyHist latQueued;                                              // Detection to pickup
+latencyHist latReport;                                              // Report to report
+latencyHist latFirst[7];                                            // Detection to first report, for each button combo
+latencyHist latLast[7];                                             // Detection to last report, for each button combo
+#endif
+
+#ifdef BENCH_LATENCY
+/****
+ * 
+ * Latency benchmark
+ * 
+ * In the bench build (env:leonardo_bench, which defines BENCH_LATENCY), 
+ * each detent is followed from the ISR to the host so that changes to how 
+ * quickly the wheel's turning reaches the host can be measured. Timer 3, 
+ * which nothing else here uses, runs at the CPU clock and counts its 
+ * overflows in benchHigh, so benchCycles() is a 32-bit count of CPU cycles 
+ * since it started. (It wraps after ~268s at 16MHz; the differences are 
+ * still right as long as no one takes that long.)
+ * 
+ * The ISR notes benchCycles() in each wheelEvent. loop() notes when it 
+ * picks up the oldest of the detents it's about to act on and then, for 
+ * each HID report it sends, when that was done. Each interval goes in a 
+ * latencyHist by how many μs it took, bin 0 for less than 16μs, bin n for 
+ * 2^(n+3) up to 2^(n+4)μs and the last bin for anything longer:
+ * 
+ *   latQueued      From detection to pickup by loop()
+ *   latReport      Each report, from the one before (or the pickup, for the first)
+ *   latFirst[s]    From detection to the first report, for button combo s
+ *   latLast[s]     From detection to the last report, for button combo s
+ * 
+ * There's no stage for fetching and decoding the configuration: that's 
+ * done when it's selected (see loadActiveConfig()), not per detent. The 
+ * "latency" command displays the histograms.
+ * 
+ ****/
+
+// Timer 3 overflow ISR. Count the overflow.
+ISR(TIMER3_OVF_vect) {
+    benchHigh++;
+}
+
+// uint32_t benchCycles() Return the number of CPU cycles since Timer 3 was started. If Timer 3 has 
+// overflowed but the ISR hasn't counted it yet (because interrupts are off), count it here.
+uint32_t benchCycles() {
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t lo = TCNT3;
+    uint16_t hi = benchHigh;
+    if ((TIFR3 & _BV(TOV3)) != 0 && lo < 0x8000) {
+        hi++;
+    }
+    SREG = sreg;
+    return (uint32_t)hi << 16 | lo;
+}
+
+// void benchStart() Start Timer 3 counting CPU cycles
+void benchStart() {
+    TCCR3A = 0x00;
+    TCCR3B = _BV(CS30);                         // Normal mode, CS3[2:0] = 0x1 i.e., no prescaling
+    TCNT3 = 0;
+    TIFR3 = _BV(TOV3);
+    TIMSK3 = _BV(TOIE3);
+}
+
+// void latencyNote(latencyHist &h, uint32_t cycles) Put a latency of cycles CPU cycles in h
+void latencyNote(latencyHist &h, uint32_t cycles) {
+    uint32_t us = cycles / (F_CPU / 1000000UL) >> 4;
+    uint8_t bin = 0;
+    while (us != 0 && bin < LAT_BINS - 1) {
+        us >>= 1;
+        bin++;
+    }
+    if (h.count[bin] != 0xFFFF) {
+        h.count[bin]++;
+    }
+    if (cycles > h.maxCycles) {
+        h.maxCycles = cycles;
+    }
+}
+
+// void benchPlayStart(uint32_t detected) Note that loop() is about to play detents, the oldest of which 
+// the ISR detected at benchCycles() detected
+void benchPlayStart(uint32_t detected) {
+    uint32_t now = benchCycles();
+    latencyNote(latQueued, now - detected);
+    benchDetected = detected;
+    benchLastReport = now;
+    benchFirstSent = false;
+}
+
+// void benchReport() Note that a HID report has just been sent
+void benchReport() {
+    uint32_t now = benchCycles();
+    latencyNote(latReport, now - benchLastReport);
+    benchLastReport = now;
+    if (!benchFirstSent) {
+        latencyNote(latFirst[selection], now - benchDetected);
+        benchFirstSent = true;
+    }
+}
+
+// void benchPlayEnd() Note that loop() has finished playing the detents and sending their reports, if it 
+// hasn't been noted already
+void benchPlayEnd() {
+    if (benchFirstSent) {
+        latencyNote(latLast[selection], benchLastReport - benchDetected);
+        benchFirstSent = false;
+    }
+}
 #endif
 
 /****
  * 
- * Timer ISR. Which timer is used depends on the processor; see #define 
- * statements, above. Turned on in setup() to occur once every 256μs. 
+ * ADC conversion complete ISR. The ADC is set up in setup() to be 
+ * auto-triggered by Timer 1 compare match B once every SAMPLE_US μs. The 
+ * conversions go round robin through the channels -- wheel 0's coil A and 
+ * coil B, then wheel 1's, and so on -- so the ISR sees each of the WHEELS 
+ * wheels' coils once every 2 * WHEELS * SAMPLE_US μs. All it has to do is 
+ * pick up the result, point the ADC at the next channel for the next 
+ * conversion and run a step of the coil's state machine in its wheel's 
+ * decoder, so it only takes a few μs, however many wheels there are. (The 
+ * pulses are ms long, so even two wheels' coils are sampled often 
+ * enough.) Calling analogRead() from a timer ISR, as we used to, spends 
+ * ~100μs per coil with interrupts off, busy waiting for the conversion.
+ * 
+ * The ADC only starts a conversion on the rising edge of the compare match 
+ * flag, so we clear the flag here, after having switched the multiplexer. 
+ * If we're ever late getting here (e.g., because a USB interrupt was being 
+ * serviced), the compare match that happens in the meantime simply doesn't 
+ * start a conversion and the next one samples the correct coil.
  * 
- * Because this replaces the ISR Arduino uses for the tone() function, 
- * that function can't be used in this sketch.
+ * Because this takes over Timer 1, PWM on the pins driven by Timer 1 (and 
+ * libraries that use it, like Servo) can't be used in this sketch.
  * 
- * The ISR implements two identical state machines, one for each coil. A 
- * coil's machine is in one of three states: *low* (its initial state), 
- * *rising*, or *rose*. 
+ * The sample then goes to decodeSample() (in decoder.cpp, which describes 
+ * how the coils' pulses are turned into steps). It filters the sample, 
+ * runs a step of that coil's state machine and says whether that completed 
+ * any steps. Keeping it apart from the hardware like this means it can be 
+ * replayed and benchmarked on a host. (The atmelavr builds are link-time 
+ * optimized, so it still ends up inline in the ISR.)
  * 
- * In state *low*, the machine is waiting for the induced voltage on its coil 
- * to rise. If, while in state *low*, the voltage rises above TRIGGER(c) the 
- * machine for the coil enters state *rising*. (Where c is the coil index -- 0 
- * for coil A, 1 for coil B.) If the voltage has not risen, the machine stays 
- * in state *low*.
+ * Steps are reported to loop() by putting a wheelEvent, which says which 
+ * wheel turned, in eventRing. (All the wheels share it.) The 
+ * ring has a single producer (this ISR) and a single consumer (loop()), and 
+ * each of them is the only one to change its own index into the ring, so 
+ * neither has to turn interrupts off to use it. If the ring is full, the 
+ * step is carried over into the next event that fits, so no steps are 
+ * lost while loop() is busy sending a long sequence. Along with which way 
+ * the wheel turned, each event says when the step happened, how long it's 
+ * been since the previous one and how big the latest pulses were.
  * 
- * In state *rising* the machine sets movement to *cc* or *cw* if movement has 
- * been newly detected. Movement has been newly detected if movement is *none* 
- * and machine for the other coil has recently entered the *rising* state. In 
- * any event, the machine then changes state to *rose*. 
+ * So that it's possible to tell whether all this keeps up, the ISR also 
+ * keeps count, in isrStats, of the samples and steps (the decoder counts 
+ * the edges), of how often 
+ * eventRing was full and of how long it takes, from reading TCNT1 on the 
+ * way in to reading it again on the way out. (So the times don't include 
+ * the register saving and restoring the compiler wraps around it.)
  * 
- * In state *rose* the machine is waiting for the induced voltage to drop 
- * below RESET(c), where c is the coil index. If it has, the machine switches 
- * to state *low*. Otherwise it remains in state "rose*."
+ * In capture mode, the ISR also puts each raw (unfiltered) sample, tagged 
+ * with its wheel and coil, in the capture block it's filling. When the block is full, it's marked for 
+ * loop() to send and the ISR goes on to the other one. If that one hasn't 
+ * been sent yet, the ISR drops samples (and counts them) until it has, so 
+ * it never waits for the serial port.
+ * 
+ * When the wheel has been left alone for IDLE_MILLIS, loop() sets 
+ * idleWanted and the ISR slows sampling down by IDLE_SLOWDOWN, which, with 
+ * loop() sleeping between interrupts, saves most of the power the 
+ * jogwheel spends doing nothing. (A turn of the wheel makes pulses many ms 
+ * long, so the first one is still seen.) The first edge after that puts 
+ * sampling back to full speed straight away, without waiting for loop(). 
+ * Raw samples are only captured at full speed.
+ * 
+ * Every BUTTON_EVERY samples, the ISR also looks at the buttons and, if 
+ * they've changed, puts a buttonEvent saying which are down in buttonRing 
+ * (which works the same way as eventRing) for buttonTask() to debounce. 
+ * That way, the button changes are timed by when they happened, not by 
+ * when loop() got around to looking, and loop() doesn't have to poll the 
+ * pins. (The button pins can't have interrupts of their own: on the 
+ * ATmega32U4, only pins on port B have pin change interrupts.)
  * 
  ****/
-ISR(TIMERx_COMPA_vect) {
-    static coilState_t state[2] = {low, low};                           // State of each coil's state machine
-    static unsigned long risingTimestamp[2] = {0, 0};                   // micros() at the point the time *rising* was last entered
-    int coilVal[2];
+
+// uint8_t readButtons() Return which buttons are down: bit 0 is A, 1 is B, 2 is C
+uint8_t readButtons() {
+    return ~buttonPins::read() & 0x07;
+}
+
+// void setSampleRate(bool slow) Have Timer 1 start a conversion every SAMPLE_US μs or, if slow, 
+// IDLE_SLOWDOWN times less often, and tell the decoders. Only the ADC ISR calls this, between conversions.
+void setSampleRate(bool slow) {
+    uint16_t ticks = slow ? SAMPLE_TICKS * IDLE_SLOWDOWN : SAMPLE_TICKS;
+    OCR1A = ticks - 1;
+    OCR1B = ticks - 1;
+    if (TCNT1 >= ticks - 2) {
+        TCNT1 = 0;                              // Already past the new top; start over rather than wait for a wrap
+    }
+    for (uint8_t w = 0; w < WHEELS; w++) {
+        dec[w].sampleUs = (slow ? SAMPLE_US * IDLE_SLOWDOWN : SAMPLE_US) * WHEELS;
+    }
+    sampleSlow = slow;
+}
+
+ISR(ADC_vect) {
+    uint16_t entryTicks = TCNT1;                                        // (First, so it's as close to entry as we can get)
+    static byte ch = 0;                                                 // The channel whose conversion just finished
+    static unsigned long detentTimestamp[WHEELS];                       // micros() at each wheel's last step
+    static int16_t carry[WHEELS];                                       // Each wheel's steps that didn't fit in eventRing
+    static uint8_t buttonCount = 0;                                     // Samples since we last looked at the buttons
+    static uint8_t lastButtons = 0;                                     // The buttons down, as last put in buttonRing
+    uint16_t top = sampleSlow ? SAMPLE_TICKS * IDLE_SLOWDOWN : SAMPLE_TICKS;    // Timer 1 ticks per sample, for now
+    int coilVal = ADC;
+    uint8_t w = ch >> 1;                                                // The wheel and coil it's from
+    uint8_t c = ch & 1;
+    coilDecoder &d = dec[w];
+    uint32_t edges = d.edges;
+
+    // Sample the next channel next time around
+    ch = ch + 1 < 2 * WHEELS ? ch + 1 : 0;
+    ADMUX = coilMux[ch];
+    TIFR1 = _BV(OCF1B);
+
+    // Capture the raw sample, if we're doing that
+    if (capturing && !sampleSlow) {
+        if (capFull[capFill]) {
+            if (capDropped != 0xFFFF) {
+                capDropped++;
+            }
+        } else {
+            captureBlock &b = capBlock[capFill];
+            if (capIx == 0) {
+                b.sync = CAP_SYNC;
+                b.seq = capSeq++;
+                b.count = CAP_SAMPLES;
+                b.dropped = capDropped;
+                b.timestamp = micros();
+                capDropped = 0;
+            }
+            b.sample[capIx++] = coilVal | (c == COIL_B ? CAP_COIL_B : 0) | w << CAP_WHEEL_SHIFT;
+            if (capIx == CAP_SAMPLES) {
+                capIx = 0;
+                __asm__ __volatile__ ("" ::: "memory");
+                capFull[capFill] = true;
+                capFill ^= 1;
+            }
+        }
+    }
 
     #ifdef DEBUG_ISR
-    coilState_t lastStateA = state[0];
-    coilState_t lastStateB = state[1];
+    coilState_t lastState = d.state[c];
     #endif
 
-    // Update state machine as needed
-    for (byte c = 0; c < 2; c++) {
-        coilVal[c] = analogRead(coilPin[c]);
-        switch (state[c]) {
-            case low:
-                if (coilVal[c] > TRIGGER(c)) {
-                    state[c] = rising;
-                }
-                break;
-            case rising:
-                if (movement == none) {
-                    risingTimestamp[c] = micros();
-                    if (risingTimestamp[c] - risingTimestamp[(c + 1) % 2] <= MAX_PULSE_SEP) {
-                        movement = c == 0 ? cc : cw;
-                    }
-                }
-                state[c] = rose;
-                break;
-            case rose:
-                if (coilVal[c] < RESET(c)) {
-                    state[c] = low;
-                }
-                break;
+    // Decode the sample and report any whole steps it completes
+    int8_t steps = decodeSample(d, c, coilVal);
+    if (steps != 0) {
+        int16_t step = steps + carry[w];
+        unsigned long now = micros();
+        uint8_t next = (eventHead + 1) & (EVENT_RING_SIZE - 1);
+        if (next == eventTail) {
+            carry[w] = step;                    // No room; try again next time
+            isrStats.ringFull++;
+        } else {
+            wheelEvent &e = eventRing[eventHead];
+            unsigned long interval = now - detentTimestamp[w];
+            e.wheel = w;
+            e.steps = constrain(step, -127, 127);
+            e.interval = interval > ACCEL_NO_INTERVAL ? ACCEL_NO_INTERVAL : interval;
+            e.timestamp = now;
+            #ifdef BENCH_LATENCY
+            e.cycles = benchCycles();
+            #endif
+            e.peak[COIL_A] = d.lastPeak[COIL_A];
+            e.peak[COIL_B] = d.lastPeak[COIL_B];
+            eventHead = next;
+            carry[w] = step - e.steps;
+            isrStats.steps += e.steps < 0 ? -e.steps : e.steps;
         }
+        detentTimestamp[w] = now;
     }
     #ifdef DEBUG_ISR
-    if ((state[0] != lastStateA || state[1] != lastStateB) && dStateIx < D_STATE_SIZE) {
-        for (byte c = 0; c < 2; c++) {
-            dState[dStateIx][c] = state[c];
-            dCoilVal[dStateIx][c] = coilVal[c];
-            dRisingTimestamp[dStateIx][c] = risingTimestamp[c];
+    if (d.state[c] != lastState && dStateIx < D_STATE_SIZE) {
+        for (byte i = 0; i < 2; i++) {
+            dState[dStateIx][i] = d.state[i];
+            dRisingTimestamp[dStateIx][i] = d.risingTimestamp[i];
         }
-        dMovement[dStateIx] = movement;
+        dCoil[dStateIx] = w << 1 | c;
+        dCoilVal[dStateIx] = coilVal;
+        dQueued[dStateIx] = (eventHead - eventTail) & (EVENT_RING_SIZE - 1);
         dStateIx++;
     }
     #endif
+
+    // Look at the buttons every so often and report any change
+    if (++buttonCount == BUTTON_EVERY) {
+        uint8_t buttons = readButtons();
+        uint8_t next = (buttonHead + 1) & (BUTTON_RING_SIZE - 1);
+        buttonCount = 0;
+        if (buttons != lastButtons && next != buttonTail) {     // (If there's no room, try again next time)
+            buttonRing[buttonHead].buttons = buttons;
+            buttonRing[buttonHead].timestamp = millis();
+            buttonHead = next;
+            lastButtons = buttons;
+        }
+    }
+
+    // Back to full speed on the first edge; slow down if loop() wants us to
+    if (d.edges != edges) {
+        idleWanted = false;
+        if (sampleSlow) {
+            setSampleRate(false);
+        }
+    } else if (idleWanted != sampleSlow) {
+        setSampleRate(idleWanted);
+    }
+
+    // Keep count
+    uint16_t ticks = TCNT1 - entryTicks;
+    if (ticks >= top) {
+        ticks += top;                           // Timer 1 went past the top (and back to 0) while we were at it
+    }
+    isrStats.samples++;
+    if (ticks < isrStats.minTicks) {
+        isrStats.minTicks = ticks;
+    }
+    if (ticks > isrStats.maxTicks) {
+        isrStats.maxTicks = ticks;
+    }
+    isrStats.avgTicks = isrStats.avgTicks - (isrStats.avgTicks >> STATS_SHIFT) + ticks;
 }
 
 /****
@@ -314,12 +859,55 @@ ISR(TIMERx_COMPA_vect) {
  * locations specified in the header block. Unused configurations have 0 for 
  * their locations. 
  * 
- * A CB consists of a count of the entries in it and the entries themselves. 
- * In EEPROM, the CBs are kept packed together starting right after the 
- * header.
+ * A CB is a flags byte followed by a variable-length encoding of the cw and 
+ * cc actions, interleaved a pair at a time. A plain ASCII keystroke takes a 
+ * single byte, a modifier byte covers all the following actions in its 
+ * direction until the next one, and, if the cc sequence is just the cw one 
+ * with its amounts negated (as with most mouse configurations) only the cw 
+ * actions are stored. (The details are in "EEPROM Usage.txt".) CBs are 
+ * written with a cbWriter: once with no address to measure the CB and find 
+ * out whether it's mirrored, and once more to write it wherever there's 
+ * room. They're read with a cbReader, one pair of actions at a time, straight 
+ * from EEPROM; only the plans for the configurations the wheels have 
+ * selected are kept in RAM. (Each takes ~400 bytes, which is what limits 
+ * how many wheels there can be.)
+ * 
+ * The header keeps track of where each CB is and how big it is. In EEPROM, 
+ * the CBs are kept in the space after the header, but not necessarily 
+ * packed together or in order: removing a CB just leaves a gap and changing 
+ * one rewrites it in place, if it fits. New and changed CBs go in the first 
+ * gap they fit in. Only when none is big enough are the CBs moved to pack 
+ * them together.
+ * 
+ * Which button combo is selected changes every time someone clicks a chord, 
+ * so rather than being part of the header, it's kept in the SEL_SLOTS bytes 
+ * at the very end of the EEPROM, each new selection going in the next slot 
+ * around. That spreads the wear over all the slots. To be able to tell 
+ * which slot is the current one, each slot also has a "phase" bit that 
+ * flips each time the writing wraps around to slot 0. The current slot is 
+ * the last one, counting from slot 0, with the same phase as slot 0.
+ * 
+ * Writing EEPROM takes ~3.3ms per byte, so the header and the selection are 
+ * written asynchronously: writeHeader() and writeSelection() just queue an 
+ * eeWrite and the EE_READY interrupt does the work, only writing the bytes 
+ * that actually changed. Writes take the values from RAM when they are 
+ * done, not when they're queued, so the source has to stay put (i.e., be a 
+ * global) until the write is finished. So that header can change while 
+ * it's being written without a mix of old and new ending up in EEPROM, 
+ * writeHeader() writes a copy of it, eeHeader, which it only changes once 
+ * the previous write of it is done. (One-byte writes, i.e., the selection, 
+ * are copied into the queue.) Everything else uses the avr-libc 
+ * eeprom functions, which wait for the EEPROM to be ready but don't know 
+ * about our queue, so they must call eeSync() first. The one exception is 
+ * reading CBs: the queue only ever writes the header and the selection 
+ * slots, so what's in a CB is always up to date. Reading one only needs 
+ * the EE_READY ISR held off, so that it can't start a write part way 
+ * through, which is what eeHold() and eeRelease() do. That way, loading a 
+ * configuration waits, at most, for the one byte being written (~3.3ms), 
+ * not for everything queued ahead of it.
  * 
  * The helper functions can read and write the header and can read, remove, 
- * and add CBs, up to the maximum of 8 and the available space in the EEPROM, 
+ * update and add CBs, up to the maximum of 8 and the available space in the EEPROM, 
  * which is only 1024 bytes. The 0th CB describes the default configuration 
  * and cannot be removed.
  * 
@@ -331,156 +919,577 @@ ISR(TIMERx_COMPA_vect) {
  * there it in EEPROM and one to return the number of currently defined 
  * configs.
  * 
+ * So that turning the wheel never has to wait for the EEPROM or pick apart 
+ * entries, the CB for the currently selected configuration is kept in RAM in 
+ * plan, compiled into a list of ready-to-play actions. The functions that 
+ * change which CB is selected or that renumber the CBs refresh it using 
+ * loadActiveConfig().
+ * 
  * NB: Except for readHeader(), all the functions assume, without checking, 
  * that the header data has already been rertieved.
  * 
  ****/
 
-// Write the header to EEPROM.
+// EEPROM ready ISR. Work on the oldest queued eeWrite until a byte that differs from what's already in 
+// EEPROM turns up; start writing it and return. The interrupt happens again when the write finishes. Look 
+// at no more than 8 bytes per interrupt so as to not hold off other interrupts for long. Turn the 
+// interrupt off when the queue is empty.
+ISR(EE_READY_vect) {
+    for (uint8_t n = 0; n < 8; n++) {
+        if (eeTail == eeHead) {
+            EECR &= ~_BV(EERIE);
+            return;
+        }
+        eeWrite &w = eeQueue[eeTail];
+        if (w.len == 0) {
+            eeTail = (eeTail + 1) & (EE_QUEUE_SIZE - 1);
+            continue;
+        }
+        uint8_t val = *w.src++;
+        EEAR = w.addr++;
+        w.len--;
+        EECR |= _BV(EERE);
+        if (EEDR != val) {
+            EEDR = val;
+            EECR |= _BV(EEMPE);
+            EECR |= _BV(EEPE);
+            return;
+        }
+    }
+}
+
+// Stop the EE_READY ISR from starting any more writes, and wait for the one under way, if any, to finish
+void eeStopWrites() {
+    EECR &= ~_BV(EERIE);
+    while ((EECR & _BV(EEPE)) != 0) {
+        // Wait for the write under way to finish
+    }
+}
+
+// Queue an asynchronous write of the len bytes at src to EEPROM address addr. If the queue is full, this 
+// blocks until there's room, which takes as long as the oldest queued write does (~3.3ms for each byte 
+// that changes). A one-byte write takes a copy of the byte, so src can change before the write gets done (as 
+// selSlotValue does if the selection changes twice in a row); a longer one writes whatever is at src by then.
+void eeQueueWrite(uint16_t addr, const void *src, uint8_t len) {
+    uint8_t next = (eeHead + 1) & (EE_QUEUE_SIZE - 1);
+    if (next == eeTail) {
+        EECR |= _BV(EERIE);                     // (Even if the queue is being held; it's that or wait forever)
+        while (next == eeTail) {
+            // Wait for the EE_READY ISR to make room
+        }
+        if (eeHolds != 0) {
+            eeStopWrites();
+        }
+    }
+    eeQueue[eeHead].addr = addr;
+    eeQueue[eeHead].src = (const uint8_t*)src;
+    if (len == 1) {
+        eeQueue[eeHead].value = *(const uint8_t*)src;
+        eeQueue[eeHead].src = &eeQueue[eeHead].value;
+    }
+    eeQueue[eeHead].len = len;
+    __asm__ __volatile__ ("" ::: "memory");
+    eeHead = next;
+    if (eeHolds == 0) {
+        EECR |= _BV(EERIE);
+    }
+}
+
+// Wait for all queued asynchronous EEPROM writes to finish. Must be called before using EEPROM directly.
+// (If the queue is being held, it's let go for the duration; when it's empty, nothing is being written.)
+void eeSync() {
+    if (eeTail != eeHead) {
+        EECR |= _BV(EERIE);
+    }
+    while (eeTail != eeHead) {
+        // Wait for the EE_READY ISR to finish up
+    }
+}
+
+// Hold off the queued asynchronous EEPROM writes so that CBs can be read (see above), waiting only for 
+// the byte being written, if any. Holds nest. Each must be undone with eeRelease().
+void eeHold() {
+    eeHolds++;
+    eeStopWrites();
+}
+
+// Undo an eeHold(). Once there are none left, the queued writes carry on.
+void eeRelease() {
+    if (--eeHolds == 0 && eeTail != eeHead) {
+        EECR |= _BV(EERIE);
+    }
+}
+
+// Write selection to the next selection slot in EEPROM, asynchronously.
+void writeSelection() {
+    selSlot = (selSlot + 1) % SEL_SLOTS;
+    if (selSlot == 0) {
+        selSlotValue ^= SEL_PHASE_MASK;
+    }
+    selSlotValue = (selSlotValue & SEL_PHASE_MASK) | selection;
+    eeQueueWrite(SEL_SLOT_ADDR + selSlot, &selSlotValue, 1);
+}
+
+// Read selection from the current selection slot in EEPROM.
+void readSelection() {
+    eeSync();
+    uint8_t phase = eeprom_read_byte((const uint8_t*)SEL_SLOT_ADDR) & SEL_PHASE_MASK;
+    selSlot = 0;
+    while (selSlot + 1 < SEL_SLOTS && 
+            (eeprom_read_byte((const uint8_t*)(SEL_SLOT_ADDR + selSlot + 1)) & SEL_PHASE_MASK) == phase) {
+        selSlot++;
+    }
+    selSlotValue = eeprom_read_byte((const uint8_t*)(SEL_SLOT_ADDR + selSlot));
+    selection = selSlotValue & SEL_VALUE_MASK;
+    if (selection >= N_ELEMENTS(header.curConfig[0])) {
+        selection = 0;
+    }
+}
+
+// Initialize the selection slots so that slot 0 is the current one and holds sel.
+void initSelection(uint8_t sel) {
+    eeSync();
+    eeprom_update_byte((uint8_t*)SEL_SLOT_ADDR, sel);
+    for (uint8_t i = 1; i < SEL_SLOTS; i++) {
+        eeprom_update_byte((uint8_t*)(SEL_SLOT_ADDR + i), SEL_PHASE_MASK);
+    }
+    selection = sel;
+    selSlot = 0;
+    selSlotValue = sel;
+}
+
+// Write the header to EEPROM, asynchronously. What's written is a snapshot of header, taken once the 
+// queued writes, including any earlier write of the header, are done; header can change right away.
 void writeHeader() {
     #ifdef DEBUG_EEPROM
-    if (header.curConfig < 0 || (size_t)header.curConfig > N_CONFIGS){
-        Serial.print(F("writeHeader - Bad header.curConfig: "));
-        Serial.println(header.curConfig);
-    }
-    if ((size_t)header.configPtr[header.curConfig] < sizeof(header) || header.configPtr[header.curConfig] > 1021) {
-        Serial.print(F("writeHeader - Bad header.configPtr["));
-        Serial.print(header.curConfig);
-        Serial.print(F("]: "));
-        Serial.println(header.configPtr[header.curConfig]);
+    for (uint8_t cbn = 0; cbn < N_ELEMENTS(header.configPtr) && header.configPtr[cbn] != 0; cbn++) {
+        if (header.configPtr[cbn] < sizeof(header) || header.configPtr[cbn] + header.configSize[cbn] > SEL_SLOT_ADDR) {
+            Serial.print(F("writeHeader - Bad header.configPtr["));
+            Serial.print(cbn);
+            Serial.print(F("]: 0x"));
+            Serial.println(header.configPtr[cbn], HEX);
+        }
     }
     #endif
-    eeprom_write_block((void*)&header, (void*)0, sizeof(header));
+    eeSync();
+    eeHeader = header;
+    eeQueueWrite(0, &eeHeader, sizeof(eeHeader));
+}
+
+// Begin a CB with w. If addr is 0, the CB is only measured. Otherwise it is written at addr, leaving out 
+// the cc actions if mirrored is true. (Which it must only be if measuring the CB said it was mirrored.)
+void beginConfig(cbWriter &w, uint16_t addr, bool mirrored) {
+    w.addr = addr;
+    w.nPairs = 0;
+    for (uint8_t dir = 0; dir < 2; dir++) {
+        w.len[dir] = 0;
+        w.mods[dir] = 0;
+    }
+    w.mirrored = addr == 0 ? true : mirrored;
+    if (addr != 0) {
+        eeSync();
+        eeprom_update_byte((uint8_t*)w.addr++, w.mirrored ? CB_MIRRORED : 0);
+    }
+}
+
+// Return the size in EEPROM of the CB w has done so far
+uint16_t cbSize(cbWriter &w) {
+    return 1 + w.len[ENTRY_CW] + (w.mirrored ? 0 : w.len[ENTRY_CC]);
+}
+
+// Put b, a byte of direction dir's actions, in the CB w is doing. Only bytes that differ from what's 
+// already in EEPROM get written.
+void putByte(cbWriter &w, uint8_t dir, uint8_t b) {
+    w.len[dir]++;
+    if (w.addr != 0 && !(dir == ENTRY_CC && w.mirrored)) {
+        eeprom_update_byte((uint8_t*)w.addr++, b);
+    }
+}
+
+// Put op, an action in direction dir, in the CB w is doing, preceded by a CB_MODS byte if its modifiers 
+// aren't the ones already in effect and a CB_REPEAT byte if it's repeated
+void putOp(cbWriter &w, uint8_t dir, const actionOp &op) {
+    if (op.mods != w.mods[dir]) {
+        putByte(w, dir, CB_MODS | op.mods);
+        w.mods[dir] = op.mods;
+    }
+    if (op.reps > 1) {
+        putByte(w, dir, CB_REPEAT | (op.reps - 1));
+    }
+    switch (op.type) {
+        case opKey:
+            if (op.code >= CB_KEY) {
+                putByte(w, dir, CB_KEY);
+            }
+            putByte(w, dir, op.code);
+            break;
+        case opClick:
+            putByte(w, dir, CB_CLICK | op.code);
+            break;
+        case opWheel:
+            putByte(w, dir, CB_WHEEL);
+            putByte(w, dir, op.x);
+            break;
+        case opMove:
+            putByte(w, dir, CB_MOVE | op.code);
+            putByte(w, dir, op.x);
+            putByte(w, dir, op.y);
+            break;
+        case opHiRes:
+            putByte(w, dir, CB_HIRES);
+            putByte(w, dir, op.x);
+            break;
+        case opConsumer:
+            putByte(w, dir, CB_CONSUMER | op.y);
+            putByte(w, dir, op.code);
+            break;
+    }
+}
+
+// Return the mirror image of op: the same action with its mouse move or wheel roll amounts negated. (A 
+// consumer control's y is part of its usage, so that's left alone.)
+actionOp mirrorOp(const actionOp &op) {
+    actionOp answer = op;
+    if (op.type != opConsumer) {
+        answer.x = -op.x;
+        answer.y = -op.y;
+    }
+    return answer;
+}
+
+// Return whether actions a and b are the same
+bool sameOp(const actionOp &a, const actionOp &b) {
+    return a.type == b.type && a.mods == b.mods && a.code == b.code && a.x == b.x && a.y == b.y && a.reps == b.reps;
+}
+
+// Put the pair of actions cw and cc in the CB w is doing. Returns false if the CB already has as many 
+// pairs as a plan has room for.
+bool putPair(cbWriter &w, const actionOp &cw, const actionOp &cc) {
+    if (w.nPairs >= PLAN_MAX_OPS) {
+        return false;
+    }
+    if (w.addr == 0) {
+        w.mirrored = w.mirrored && sameOp(cc, mirrorOp(cw));
+    }
+    putOp(w, ENTRY_CW, cw);
+    putOp(w, ENTRY_CC, cc);
+    w.nPairs++;
+    return true;
 }
 
-// Write config block n, n:[0..N_CONFIGS - 1]
-void writeConfig(int8_t cbn, configBlock &cb) {
-    if (cbn < 0 || (uint8_t)cbn >= N_ELEMENTS(header.configPtr)) {
-        cb.nEntries = 0;
+// Begin reading CB cbn with r. Returns false if there's no such CB. Must be called (and r used) between an 
+// eeHold() and its eeRelease().
+bool openConfig(uint8_t cbn, cbReader &r) {
+    if (cbn >= N_ELEMENTS(header.configPtr) || header.configPtr[cbn] == 0) {
         #ifdef DEBUG_EEPROM
-        Serial.print(F("writeConfig - Bad cbn: "));
+        Serial.print(F("openConfig - Bad cbn: "));
         Serial.println(cbn);
         #endif
-        return;
+        return false;
     }
-    #ifdef DEBUG_EEPROM
-    if ((size_t)header.configPtr[cbn] < sizeof(header) || header.configPtr[cbn] > 1021) {
-        Serial.print(F("writeConfig - Bad header.configPtr["));
-        Serial.print(cbn);
-        Serial.print(F("]: "));
-        Serial.println(header.configPtr[cbn], HEX);
+    r.ram = NULL;
+    r.addr = header.configPtr[cbn];
+    r.end = r.addr + header.configSize[cbn];
+    r.mirrored = (eeprom_read_byte((const uint8_t*)r.addr++) & CB_MIRRORED) != 0;
+    r.mods[ENTRY_CW] = 0;
+    r.mods[ENTRY_CC] = 0;
+    r.bad = false;
+    return true;
+}
+
+// Begin reading the size byte CB at cb, in RAM, with r. Returns false if it doesn't even have a flags byte.
+bool openRamConfig(const uint8_t *cb, uint8_t size, cbReader &r) {
+    if (size == 0) {
+        return false;
     }
-    if (cb.nEntries < 1 || (size_t)cb.nEntries > sizeof(cb.entry) / sizeof(cb.entry[0])) {
-        Serial.print(F("writeConfig - Bad cb.nEntries: "));
-        Serial.println(cb.nEntries);
+    r.ram = cb;
+    r.addr = 1;
+    r.end = size;
+    r.mirrored = (cb[0] & CB_MIRRORED) != 0;
+    r.mods[ENTRY_CW] = 0;
+    r.mods[ENTRY_CC] = 0;
+    r.bad = false;
+    return true;
+}
+
+// Return the next byte of the CB r is reading, or 0 (and note that r went bad) if there are no more
+uint8_t getByte(cbReader &r) {
+    if (r.addr >= r.end) {
+        r.bad = true;
+        return 0;
     }
-    Serial.print(F("writeConfig -- write parms: 0x"));
-    Serial.print((uint16_t)&cb, HEX);
-    Serial.print(F(", 0x"));
-    Serial.print(header.configPtr[cbn], HEX);
-    Serial.print(F(", 0x"));
-    Serial.println(sizeof(cb.nEntries) + sizeof(cb.entry[0]) * cb.nEntries, HEX);
-    #endif
-    // Write config, including the entries (all cb.nEntries of them) for config number cbn
-    eeprom_write_block((void*)&cb, (void*)header.configPtr[cbn], sizeof(cb.nEntries) + sizeof(cb.entry[0]) * cb.nEntries);
+    return r.ram != NULL ? r.ram[r.addr++] : eeprom_read_byte((const uint8_t*)r.addr++);
 }
 
-// Read config block n, n:[0..N_CONFIGS - 1] into passed cb. Assumes header is properly populated.
-bool readConfig(int8_t cbn, configBlock &cb) {
-    if (cbn < 0 || (uint8_t)cbn >= N_ELEMENTS(header.configPtr)) {
-        cb.nEntries = 0;
+// Get the next action in direction dir from the CB r is reading into op. Returns false if there are no 
+// more or the CB doesn't make sense. (In which case r.bad gets set.)
+bool getOp(cbReader &r, uint8_t dir, actionOp &op) {
+    uint8_t reps = 1;
+    while (r.addr < r.end) {
+        uint8_t b = getByte(r);
+        if ((b & CB_MODS_MASK) == CB_MODS) {
+            r.mods[dir] = b & ~CB_MODS_MASK;
+            continue;
+        }
+        if ((b & CB_REPEAT_MASK) == CB_REPEAT && b != CB_KEY) {
+            reps = (b & ~CB_REPEAT_MASK) + 1;
+            continue;
+        }
+        op.type = opKey;
+        op.mods = r.mods[dir];
+        op.code = b;
+        op.x = 0;
+        op.y = 0;
+        op.reps = reps;
+        if (b < CB_KEY) {
+            return true;
+        }
+        if (b == CB_KEY) {
+            op.code = getByte(r);
+            return !r.bad;
+        }
+        op.code = b & CB_ARG_MASK;
+        switch (b & CB_OP_MASK) {
+            case CB_CLICK:
+                op.type = opClick;
+                return true;
+            case CB_WHEEL:
+                if (op.code > (CB_HIRES & CB_ARG_MASK)) {
+                    break;                      // (Reserved)
+                }
+                op.type = op.code == 0 ? opWheel : opHiRes;
+                op.code = 0;
+                op.x = getByte(r);
+                return !r.bad;
+            case CB_MOVE:
+                op.type = opMove;
+                op.x = getByte(r);
+                op.y = getByte(r);
+                return !r.bad;
+            case CB_CONSUMER:
+                op.type = opConsumer;
+                op.y = op.code;
+                op.code = getByte(r);
+                return !r.bad;
+        }
         #ifdef DEBUG_EEPROM
-        Serial.print(F("readConfig - Bad cbn: "));
-        Serial.println(cbn);
+        Serial.print(F("getOp - Bad CB byte: 0x"));
+        Serial.println(b, HEX);
         #endif
+        r.bad = true;
         return false;
     }
-    #ifdef DEBUG_EEPROM
-    if ((size_t)header.configPtr[cbn] < sizeof(header) || header.configPtr[cbn] > 1021) {
-        Serial.print(F("readConfig - Bad header.configPtr["));
-        Serial.print(cbn);
-        Serial.print(F("]: "));
-        Serial.println(header.configPtr[cbn], HEX);
+    r.bad = r.bad || reps != 1;                 // A CB_REPEAT without its action
+    return false;
+}
+
+// Get the next pair of actions from the CB r is reading into cw and cc. Returns false if there are no more.
+bool getPair(cbReader &r, actionOp &cw, actionOp &cc) {
+    if (!getOp(r, ENTRY_CW, cw)) {
+        return false;
     }
-    #endif
-    // Retrieve value of cb.nEntries for config number cbn
-    eeprom_read_block((void*)&cb.nEntries, (const void*)header.configPtr[cbn], sizeof(cb.nEntries));
-    #ifdef DEBUG_EEPROM
-    if (cb.nEntries < 1 || (size_t)cb.nEntries > sizeof(cb.entry) / sizeof(cb.entry[0])) {
-        Serial.print(F("readConfig - Bad cb.nEntries: "));
-        Serial.println(cb.nEntries);
+    if (r.mirrored) {
+        cc = mirrorOp(cw);
+        return true;
+    }
+    if (!getOp(r, ENTRY_CC, cc)) {
+        r.bad = true;                           // A cw action without its cc one
+        return false;
+    }
+    return true;
+}
+
+// Return the modifier keys in a keyboard entry or a type 0, 2 or 3 mouse entry as actionOp.mods bits
+uint8_t decodeMods(uint16_t entry) {
+    return ((entry & KB_CTRL_MASK) != 0 ? 0x01 : 0) | ((entry & KB_SHIFT_MASK) != 0 ? 0x02 : 0) |
+           ((entry & KB_ALT_MASK) != 0 ? 0x04 : 0) | ((entry & KB_GUI_MASK) != 0 ? 0x08 : 0);
+}
+
+// Turn entry, as returned by one of the parsers, into op. For a mouse move, entry is the type 1 mouse 
+// entry and entryY is its type 2 partner. Keystrokes are left as Keyboard library key codes.
+void entryToOp(uint16_t entry, uint16_t entryY, actionOp &op) {
+    op.mods = decodeMods(entry);
+    op.code = 0;
+    op.x = 0;
+    op.y = 0;
+    op.reps = 1;
+    if ((entry & CE_TYPE_MASK) == 0) {
+        op.type = opKey;
+        op.code = entry & KB_VALUE_MASK;
+        return;
+    }
+    switch (ME_TYPE(entry)) {
+        case ME_TYPE_WHEEL:
+            op.type = opWheel;
+            op.x = entry & ME_VALUE_MASK;
+            break;
+        case ME_TYPE_X:
+        case ME_TYPE_Y:
+            op.type = opMove;
+            op.mods = decodeMods(entryY);
+            op.code = ((entry & ME1_LEFT_MASK) != 0 ? MOUSE_LEFT : 0) |
+                      ((entry & ME1_MID_MASK) != 0 ? MOUSE_MIDDLE : 0) |
+                      ((entry & ME1_RIGHT_MASK) != 0 ? MOUSE_RIGHT : 0);
+            op.x = entry & ME_VALUE_MASK;
+            op.y = entryY & ME_VALUE_MASK;
+            break;
+        case ME_TYPE_CLICK:
+            op.type = opClick;
+            op.code = ((entry & ME3_LEFT_MASK) != 0 ? MOUSE_LEFT : 0) |
+                      ((entry & ME3_MID_MASK) != 0 ? MOUSE_MIDDLE : 0) |
+                      ((entry & ME3_RIGHT_MASK) != 0 ? MOUSE_RIGHT : 0);
+            break;
+    }
+}
+
+// Add the action op to the end of direction dir's actions in p. Keystrokes are turned into the HID usage 
+// and modifiers that go in a keyboard report. If MERGE_WHEEL is defined, a wheel roll with the same 
+// modifiers as the wheel roll before it is merged into that one. Returns false if there's no room.
+bool addToPlan(actionPlan &p, uint8_t dir, actionOp op) {
+    if (op.type == opKey) {
+        uint8_t k = op.code;
+        op.code = 0;
+        if (k >= 136) {                         // Non-printing key (These are HID usage + 136)
+            op.code = k - 136;
+        } else if (k >= 128) {                  // Modifier key by itself
+            op.mods |= 1 << (k - 128);
+        } else {                                // ASCII character
+            op.code = pgm_read_byte(hidUsage + k);
+            if ((op.code & HID_SHIFT) != 0) {
+                op.mods |= HID_MOD_SHIFT;
+                op.code &= ~HID_SHIFT;
+            }
+        }
+    }
+    if (op.type == opKey || op.type == opClick || op.type == opConsumer) {
+        p.scalable[dir] = false;
+    }
+    #ifdef MERGE_WHEEL
+    if (op.type == opWheel && p.nOps[dir] > 0) {
+        actionOp &last = p.op[dir][p.nOps[dir] - 1];
+        if (last.type == opWheel && last.mods == op.mods && last.reps == 1 && op.reps == 1 && 
+                last.x + op.x >= -127 && last.x + op.x <= 127) {
+            last.x += op.x;
+            return true;
+        }
     }
     #endif
-    // Retrieve the entries (all cb.nEntries of them) for config number cbn
-    int16_t entryEepromAddr = header.configPtr[cbn] + sizeof(cb.nEntries);
-    #ifdef DEBUG_EEPROM
-    Serial.print(F("readConfig - Reading "));
-    Serial.print(cb.nEntries);
-    Serial.print(F(" entries for config "));
-    Serial.print(cbn);
-    Serial.print(F(" at EEPROM addr 0x"));
-    Serial.print(header.configPtr[cbn], HEX);
-    Serial.print(F(". Read parms: 0x"));
-    Serial.print((uint16_t)&cb.entry, HEX);
-    Serial.print(F(", 0x"));
-    Serial.print((uint16_t)entryEepromAddr, HEX);
-    Serial.print(F(", "));
-    Serial.println(sizeof(cb.entry[0]) * cb.nEntries);
-    delay(100);
-    #endif
-    eeprom_read_block((void*)&cb.entry, (const void*)entryEepromAddr, sizeof(cb.entry[0]) * cb.nEntries);
+    if (p.nOps[dir] >= PLAN_MAX_OPS) {
+        return false;
+    }
+    p.op[dir][p.nOps[dir]++] = op;
     return true;
 }
 
-// Read header block into header. If what we read doesn't have the right fingerprint, initialize to the
-// starter configuration set.
+// Make p the plan for the CB r has just been opened on (or, if opened is false, an empty plan) with 
+// acceleration level accel
+void loadPlan(actionPlan &p, cbReader &r, bool opened, uint8_t accel) {
+    actionOp op[2];
+    for (uint8_t dir = 0; dir < 2; dir++) {
+        p.nOps[dir] = 0;
+        p.scalable[dir] = true;
+    }
+    if (opened) {
+        while (getPair(r, op[ENTRY_CW], op[ENTRY_CC])) {
+            addToPlan(p, ENTRY_CW, op[ENTRY_CW]);
+            addToPlan(p, ENTRY_CC, op[ENTRY_CC]);
+        }
+    }
+    p.accel = accel;
+}
+
+// Refresh each wheel's plan from the CB currently selected for it by header. Call whenever selection, 
+// header.curConfig or the numbering of the CBs changes.
+void loadActiveConfig() {
+    stopPlaying(player);                        // (What's left of the old configuration's actions is dropped)
+    eeHold();
+    for (uint8_t w = 0; w < WHEELS; w++) {
+        uint8_t cbn = header.curConfig[w][selection];
+        cbReader r;
+        bool opened = openConfig(cbn, r);
+        loadPlan(plan[w], r, opened, cbn < N_ELEMENTS(header.accel) ? header.accel[cbn] : 0);
+    }
+    eeRelease();
+}
+
+// Put the default configuration, k0xDA 0xD9, in the CB w is doing. (A cbSource.)
+bool defaultConfig(cbWriter &w) {
+    actionOp up = {opKey, 0, KEY_UP_ARROW, 0, 0, 1};
+    actionOp down = {opKey, 0, KEY_DOWN_ARROW, 0, 0, 1};
+    return putPair(w, up, down);
+}
+
+// Read header block into header and the current selection slot into selection. If what we read doesn't 
+// have the right fingerprint, initialize to the starter configuration set.
 bool readHeader() {
+    eeSync();
     eeprom_read_block((void*)&header, (const void*)0, sizeof(header));
     #ifdef FACTORY_RESET
     header.fingerprint = 0; // Force regen each time
     #endif
     if (header.fingerprint == FINGERPRINT) {    // It's ours; use it
-
+        readSelection();
         return true;
     } else {                                    // Not ours; synthesize the default
-        configBlock cb;
+        cbWriter w;
         header.fingerprint = FINGERPRINT;
-        header.selection = 1;
-        for (uint8_t i = 0; i < N_ELEMENTS(header.curConfig); i++) {
-            header.curConfig[i] = 0;            // Set all button combos to config 0
-        }
+        initSelection(1);
+        memset(header.curConfig, 0, sizeof(header.curConfig));  // Set all button combos to config 0
         header.configPtr[0] = sizeof(header);   // Config 0 starts right after header
         for (byte i = 1; i < N_ELEMENTS(header.configPtr); i++) {
             header.configPtr[i] = 0;            // Rest are unused
+            header.configSize[i] = 0;
+        }
+        for (byte i = 0; i < N_ELEMENTS(header.accel); i++) {
+            header.accel[i] = 0;                // No acceleration
         }
-        cb.nEntries = 1;                        // Config 0 is k0xDA 0xD9
-        cb.entry[0][ENTRY_CW] = KEY_UP_ARROW;
-        cb.entry[0][ENTRY_CC] = KEY_DOWN_ARROW;
+        for (uint8_t w = 0; w < WHEELS; w++) {
+            header.trigger[w][COIL_A] = TRIGGER_A;  // Uncalibrated levels
+            header.trigger[w][COIL_B] = TRIGGER_B;
+            header.reset[w][COIL_A] = RESET_A;
+            header.reset[w][COIL_B] = RESET_B;
+        }
+        beginConfig(w, 0, false);               // Measure config 0
+        defaultConfig(w);
+        header.configSize[0] = cbSize(w);
         writeHeader();                          // Initialize eeprom
-        writeConfig(0, cb);
+        beginConfig(w, header.configPtr[0], w.mirrored);
+        defaultConfig(w);
     }
     return false;
 }
 
-// Set the current config for button combination combo to configuration number cbn. 
+// Set the current config of wheel w for button combination combo to configuration number cbn. 
 // The result is that the header is updated in EEPROM (if needed).
-// Returns true if succeeded, false if passed invalid combo or invalid or currently unused cbn.
-bool setConfig(uint8_t combo, uint8_t cbn) {
-    if (cbn >= N_ELEMENTS(header.configPtr) || combo >= N_ELEMENTS(header.curConfig) || header.configPtr[cbn] == 0) {
+// Returns true if succeeded, false if passed invalid wheel, invalid combo or invalid or currently unused cbn.
+bool setConfig(uint8_t w, uint8_t combo, uint8_t cbn) {
+    if (w >= WHEELS || cbn >= N_ELEMENTS(header.configPtr) || combo >= N_ELEMENTS(header.curConfig[0]) || 
+            header.configPtr[cbn] == 0) {
+        return false;
+    }
+    header.curConfig[w][combo] = cbn;
+    writeHeader();
+    loadActiveConfig();
+    return true;
+}
+
+// Set the acceleration level of configuration number cbn to level. The header is updated in EEPROM.
+// Returns true if succeeded, false if passed invalid or currently unused cbn or invalid level.
+bool setAccel(uint8_t cbn, uint8_t level) {
+    if (cbn >= N_ELEMENTS(header.configPtr) || header.configPtr[cbn] == 0 || level > ACCEL_MAX_LEVEL) {
         return false;
     }
-    header.curConfig[combo] = cbn;
+    header.accel[cbn] = level;
     writeHeader();
+    loadActiveConfig();
     return true;
 }
 
-// Return the number of bytes of free space remain in EEPROM
+// Return the number of bytes of free space remain in EEPROM. (It may not all be in one piece.)
 size_t freeSpace() {
-    size_t fs = 1024 - sizeof(header);
-    configBlock cb;
+    size_t fs = SEL_SLOT_ADDR - sizeof(header);
     for (uint8_t cbn = 0; cbn < N_ELEMENTS(header.configPtr) && header.configPtr[cbn] != 0; cbn++) {
-        readConfig(cbn, cb);
-        fs -= cb.nEntries * sizeof(cb.entry[0]);
+        fs -= header.configSize[cbn];
     }
     #ifdef DEBUG_EEPROM
     Serial.print(F("freeSpace -- Remaining: "));
@@ -501,202 +1510,580 @@ uint8_t nConfigs() {
     return answer;
 }
 
-// Remove config block cbn, compact the header's list of configs, the higher 
-// numbered CBs and revise the combo to config map, as needed. If a combo is  
-// using the config that's being removed, set the it to use the default 
-// config. Success returns true; failure, false.
-bool removeConfig(uint8_t cbn) {
-    configBlock cb;
-    if (cbn < 1 || cbn >= N_ELEMENTS(header.configPtr) || header.configPtr[cbn] == 0) {
-        return false;
+// Return the lowest EEPROM address where size bytes fit without overlapping any CB other than CB exclude. 
+// Returns 0 if there's no gap big enough.
+uint16_t findSpace(uint8_t size, uint8_t exclude) {
+    uint16_t answer = 0;
+    for (uint8_t i = 0; i <= N_ELEMENTS(header.configPtr); i++) {
+        // Candidates are right after the header and right after each CB
+        uint16_t candidate;
+        if (i == N_ELEMENTS(header.configPtr)) {
+            candidate = sizeof(header);
+        } else if (header.configPtr[i] != 0 && i != exclude) {
+            candidate = header.configPtr[i] + header.configSize[i];
+        } else {
+            continue;
+        }
+        if (candidate + size > SEL_SLOT_ADDR || (answer != 0 && candidate >= answer)) {
+            continue;
+        }
+        bool fits = true;
+        for (uint8_t j = 0; j < N_ELEMENTS(header.configPtr) && fits; j++) {
+            fits = header.configPtr[j] == 0 || j == exclude ||
+                   header.configPtr[j] >= candidate + size || header.configPtr[j] + header.configSize[j] <= candidate;
+        }
+        if (fits) {
+            answer = candidate;
+        }
     }
-    for (uint8_t combo = 0; combo < N_ELEMENTS(header.curConfig); combo++) {
-        if (header.curConfig[combo] == cbn) {
-            header.curConfig[combo] = 0;        // if combo uses config being removed, use default
+    return answer;
+}
+
+// Move the CBs other than CB exclude down in EEPROM, lowest first, so that the free space, including 
+// where exclude is, is all in one piece after them. (exclude is about to be replaced, so it's fine to 
+// overwrite it. Pass N_CONFIGS to move all the CBs.) Copying goes byte by byte, lowest address first, 
+// so it's fine for a CB to overlap where it used to be.
+void compactConfigs(uint8_t exclude) {
+    uint16_t next = sizeof(header);
+    uint8_t nMoving = nConfigs() - (exclude < nConfigs() ? 1 : 0);
+    eeSync();
+    for (uint8_t nDone = 0; nDone < nMoving; nDone++) {
+        uint8_t low = N_ELEMENTS(header.configPtr);
+        for (uint8_t cbn = 0; cbn < nConfigs(); cbn++) {
+            if (cbn != exclude && header.configPtr[cbn] >= next && 
+                    (low == N_ELEMENTS(header.configPtr) || header.configPtr[cbn] < header.configPtr[low])) {
+                low = cbn;
+            }
+        }
+        for (uint8_t i = 0; i < header.configSize[low] && header.configPtr[low] != next; i++) {
+            eeprom_update_byte((uint8_t*)(next + i), eeprom_read_byte((const uint8_t*)(header.configPtr[low] + i)));
         }
-        if (header.curConfig[combo] > cbn) {
-            header.curConfig[combo]--;          // Account for compaction, if needed
+        header.configPtr[low] = next;
+        next += header.configSize[low];
+    }
+    writeHeader();
+}
+
+// Find room for a CB of size bytes to replace CB exclude (or, if exclude is N_CONFIGS, to be added), moving 
+// the other CBs together if that's what it takes. Returns the EEPROM address or 0 if it won't fit.
+uint16_t allocConfig(uint8_t size, uint8_t exclude) {
+    uint16_t answer = findSpace(size, exclude);
+    size_t avail = freeSpace() + (exclude < N_ELEMENTS(header.configPtr) ? header.configSize[exclude] : 0);
+    if (answer == 0 && size <= avail) {
+        compactConfigs(exclude);
+        answer = findSpace(size, exclude);
+    }
+    return answer;
+}
+
+// Remove config block cbn, compact the header's list of configs and revise the combo to config map, as 
+// needed. The space cbn was using is simply left free; the other CBs don't move. If a combo is using the 
+// config that's being removed, set the it to use the default config. Success returns true; failure, false.
+bool removeConfig(uint8_t cbn) {
+    if (cbn < 1 || cbn >= N_ELEMENTS(header.configPtr) || header.configPtr[cbn] == 0) {
+        return false;
+    }
+    for (uint8_t w = 0; w < WHEELS; w++) {
+        for (uint8_t combo = 0; combo < N_ELEMENTS(header.curConfig[w]); combo++) {
+            if (header.curConfig[w][combo] == cbn) {
+                header.curConfig[w][combo] = 0; // if combo uses config being removed, use default
+            }
+            if (header.curConfig[w][combo] > cbn) {
+                header.curConfig[w][combo]--;   // Account for compaction, if needed
+            }
         }
     }
-    readConfig(cbn, cb);
-    size_t delta = cb.nEntries * sizeof(cb.entry[0]) + sizeof(cb.nEntries);
-    for (uint8_t cbi = cbn + 1; cbi < N_ELEMENTS(header.configPtr); cbi++) {
-        if (header.configPtr[cbi] == 0) {
+    for (uint8_t cbi = cbn + 1; cbi <= N_ELEMENTS(header.configPtr); cbi++) {
+        if (cbi == N_ELEMENTS(header.configPtr) || header.configPtr[cbi] == 0) {
             header.configPtr[cbi - 1] = 0;
+            header.configSize[cbi - 1] = 0;
+            header.accel[cbi - 1] = 0;
             break;
         }
-        readConfig(cbi, cb);
-        uint16_t newPtr = header.configPtr[cbi] - delta;
-        header.configPtr[cbi] = 0;
-        writeConfig(cbi - 1, cb);
-        header.configPtr[cbi - 1] = newPtr;
+        header.configPtr[cbi - 1] = header.configPtr[cbi];
+        header.configSize[cbi - 1] = header.configSize[cbi];
+        header.accel[cbi - 1] = header.accel[cbi];
     }
     writeHeader();
+    loadActiveConfig();
     return true;
 }
 
 
-// Add config block to the end of the list of current configs. Returns true if 
-// successful, false if it won't fit in what's left in EEPROM
-bool addConfig(configBlock toAdd) {
-    configBlock cb;
-    if (toAdd.nEntries * sizeof(toAdd.entry[0]) > freeSpace() || header.configPtr[N_ELEMENTS(header.configPtr) - 1] != 0) {
+// Add the configuration src puts to the end of the list of current configs. m is a cbWriter src has 
+// already measured the configuration with. Returns true if successful, false if it won't fit in what's 
+// left in EEPROM.
+bool addConfig(cbWriter &m, cbSource src) {
+    uint8_t cbn = nConfigs();
+    uint16_t size = cbSize(m);
+    uint16_t addr = cbn < N_ELEMENTS(header.configPtr) && size <= CB_MAX_SIZE ? 
+        allocConfig(size, N_ELEMENTS(header.configPtr)) : 0;
+    if (addr == 0) {
         #ifdef DEBUG_EEPROM
         Serial.print(F("addConfig -- Can't fit new config into eeprom."));
         #endif
         return false;
     }
-    int8_t cbn = 1;
-    while (header.configPtr[cbn] != 0) {
-        cbn++;
-    }
-    readConfig(cbn - 1, cb);
-    header.configPtr[cbn] = header.configPtr[cbn - 1] + sizeof(cb.nEntries) + cb.nEntries * sizeof(cb.entry[0]);
+    header.configPtr[cbn] = addr;
+    header.configSize[cbn] = size;
+    header.accel[cbn] = 0;
     #ifdef DEBUG_EEPROM
     Serial.print(F("Adding new config at "));
     Serial.print(cbn);
     Serial.print(F(" at eeprom address 0x"));
     Serial.print(header.configPtr[cbn], HEX);
     Serial.print(F(" with size "));
-    Serial.println(sizeof(toAdd.nEntries) + sizeof(toAdd.entry[0]) * toAdd.nEntries);
+    Serial.println(size);
     #endif
-    writeConfig(cbn, toAdd);
+    cbWriter w;
+    beginConfig(w, addr, m.mirrored);
+    src(w);
+    writeHeader();
+    loadActiveConfig();
+    return true;
+}
+
+// Replace config block cbn with the configuration src puts, keeping its number, combos and acceleration. 
+// m is a cbWriter src has already measured the configuration with. If it fits where cbn is now, it's 
+// written in place (and only the bytes that changed get written). Otherwise it goes wherever there's room. 
+// Either way, none of the other CBs move unless that's the only way to make room. Returns true if 
+// successful, false if cbn is invalid or the configuration won't fit.
+bool updateConfig(uint8_t cbn, cbWriter &m, cbSource src) {
+    uint16_t size = cbSize(m);
+    if (cbn < 1 || cbn >= N_ELEMENTS(header.configPtr) || header.configPtr[cbn] == 0 || size > CB_MAX_SIZE) {
+        return false;
+    }
+    uint16_t end = SEL_SLOT_ADDR;
+    for (uint8_t i = 0; i < N_ELEMENTS(header.configPtr); i++) {
+        if (header.configPtr[i] > header.configPtr[cbn] && header.configPtr[i] < end) {
+            end = header.configPtr[i];
+        }
+    }
+    if (header.configPtr[cbn] + size > end) {
+        uint16_t addr = allocConfig(size, cbn);
+        if (addr == 0) {
+            return false;
+        }
+        header.configPtr[cbn] = addr;
+    }
+    header.configSize[cbn] = size;
+    cbWriter w;
+    beginConfig(w, header.configPtr[cbn], m.mirrored);
+    src(w);
     writeHeader();
+    loadActiveConfig();
     return true;
 }
 
 /****
  * 
- * Misc helper functions
+ * HID report emitter
+ * 
+ * The actions in the plan are played by building keyboard and mouse HID 
+ * reports directly rather than by going through the Keyboard and Mouse 
+ * libraries, which send a report for every key or button that goes down or 
+ * comes up. Instead, as with a real keyboard, everything that goes down for 
+ * an action goes in one report and everything that comes up goes in 
+ * another, so, e.g., ctrl-shift-z is two reports rather than five. (The 
+ * libraries still provide the HID descriptors and nothing else uses them 
+ * to send reports, so the state they keep doesn't get out of step.)
+ * 
+ * The reports aren't sent as they're made. They go in reportQueue, and
+ * paceReports() sends them one per USB frame, i.e., one each time the host
+ * polls for one. Sent back to back, some hosts merge or drop the key down
+ * and key up reports of a burst of keystrokes; this way every report gets
+ * a frame of its own, and no more time than that. wheelTask() paces itself
+ * by the queue: it only plays more actions while the queue is nearly
+ * empty. If an action makes more reports than there's room for,
+ * queueReport() sends the older ones as it goes, as HID().SendReport()
+ * would have waited for the host anyway.
+ * 
+ * Consumer controls (media keys like volume up and play/pause) and
+ * high-resolution wheel rolls go in reports of their own, as laid out by
+ * hidDescriptor[]. A high-resolution roll is in HID_HIRES_CLICK-ths of a
+ * wheel click; since it's 16 bits, a whole batch of detents' worth is one
+ * report. This relies on the host setting the Resolution Multiplier to its
+ * maximum, as hosts that know about it (Windows since 8, Linux since 5.0) 
+ * do. The HID library doesn't tell us what the host sets it to. (A host
+ * that doesn't know scrolls HID_HIRES_CLICK times too far; that's what the
+ * plain wheel rolls are for.)
+ * 
+ * On processors without USB, the actions are printed instead.
  * 
  ****/
 
-// void printConfigK(uint entry[2]) Format and print both parts of a keystroke entry
-void printConfigK(uint16_t entry[]) {
-    for (uint8_t dir = 0; dir < 2; dir++) {
-        if ((entry[dir] & KB_CTRL_MASK) != 0) {
-            Serial.print(F("c"));
-        }
-        if ((entry[dir] & KB_ALT_MASK) != 0){
-            Serial.print(F("a"));
-        }
-        if ((entry[dir] & KB_SHIFT_MASK) != 0) {
-            Serial.print(F("s"));
-        }
-        if ((entry[dir] & KB_GUI_MASK) != 0) {
-            Serial.print(F("g"));
-        }
-        char ks = entry[dir] & KB_VALUE_MASK;
-        if (isPrintable(ks) && ks > ' ') {
-            Serial.print(F("\'"));
-            Serial.print(ks);
-        } else {
-            Serial.print(F("0x"));
-            Serial.print((uint8_t)ks, HEX);
-        }
-        Serial.print(F(" "));
+// const __FlashStringHelper *opLetter(opType_t type) Return the <spec-type> letter for actions of kind type
+const __FlashStringHelper *opLetter(opType_t type) {
+    switch (type) {
+        case opKey:
+            return F("k");
+        case opWheel:
+            return F("w");
+        case opMove:
+            return F("m");
+        case opClick:
+            return F("c");
+        case opHiRes:
+            return F("h");
+        case opConsumer:
+            return F("u");
     }
+    return F("?");
 }
 
-// void printConfigM(uint16_t entryA[], entryB[]) Format and print both parts of a mouse move double entry
-void printConfigM(uint16_t entryA[], uint16_t entryB[]) {
-    for (uint8_t dir = 0; dir < 2; dir++) {
-        if ((entryB[dir] & ME_CTRL_MASK) != 0) {
-            Serial.print(F("c"));
-        }
-        if ((entryB[dir] & ME_ALT_MASK) != 0){
-            Serial.print(F("a"));
-        }
-        if ((entryB[dir] & ME_SHIFT_MASK) != 0) {
-            Serial.print(F("s"));
-        }
-        if ((entryB[dir] & ME_GUI_MASK) != 0) {
-            Serial.print(F("g"));
-        }
-        if ((entryA[dir] & ME1_LEFT_MASK) != 0) {
-            Serial.print(F("l"));
-        }
-        if ((entryA[dir] & ME1_MID_MASK) != 0){
-            Serial.print(F("m"));
-        }
-        if ((entryA[dir] & ME1_RIGHT_MASK) != 0) {
-            Serial.print(F("r"));
-        }
-        int8_t val = entryA[dir] & ME_VALUE_MASK;
-        if (val >= 0) {
-            Serial.print(F("+"));
-        }
-        Serial.print(val);
-        val = entryB[dir] & ME_VALUE_MASK;
-        if (val >= 0) {
-            Serial.print(F("+"));
-        }
-        Serial.print(val);
-        Serial.print(F(" "));
+// uint16_t consumerUsage(const actionOp &op) Return the Consumer page usage of op, an opConsumer action
+uint16_t consumerUsage(const actionOp &op) {
+    return (uint16_t)(uint8_t)op.y << 8 | op.code;
+}
+
+#ifdef __AVR_ATmega32U4__
+// Count a HID report as sent or not, according to what HID().SendReport() returned for it
+void countReport(int result) {
+    if (result < 0) {
+        hidFailures++;
+    } else {
+        hidReports++;
+    }
+    #ifdef BENCH_LATENCY
+    benchReport();
+    #endif
+}
+
+// Return the number of HID reports waiting in reportQueue
+uint8_t reportsQueued() {
+    return (reportHead - reportTail) & (REPORT_QUEUE_SIZE - 1);
+}
+
+// Send the oldest report in reportQueue, if there is one and the host has started a USB frame since the 
+// last one was sent. If there have been no frames for REPORT_STALL_MILLIS (the host has suspended us, say, 
+// or there is no host), send it anyway and let HID().SendReport() decide what to do with it.
+void paceReports() {
+    static uint8_t sentFrame = 0;               // The USB frame number (low 8 bits) when the last report was sent
+    static unsigned long sentMillis = 0;        // millis() then
+    if (reportTail == reportHead || (UDFNUML == sentFrame && millis() - sentMillis < REPORT_STALL_MILLIS)) {
+        return;
     }
+    const hidReport &r = reportQueue[reportTail];
+    countReport(HID().SendReport(r.id, r.data, r.len));
+    reportTail = (reportTail + 1) & (REPORT_QUEUE_SIZE - 1);
+    sentFrame = UDFNUML;
+    sentMillis = millis();
 }
 
-// printConfigW(uint16_t entry[])  Format and print both parts of a wheel roll entry
-void printConfigW(uint16_t entry[]) {
-    for (uint8_t dir = 0; dir < 2; dir++) {
-        if ((entry[dir] & ME_CTRL_MASK) != 0) {
-            Serial.print(F("c"));
-        }
-        if ((entry[dir] & ME_ALT_MASK) != 0){
-            Serial.print(F("a"));
+// Put the len byte report with report ID id at data in reportQueue to be sent. If the queue is full, wait, 
+// sending the older ones, until there's room.
+void queueReport(uint8_t id, const uint8_t *data, uint8_t len) {
+    uint8_t next = (reportHead + 1) & (REPORT_QUEUE_SIZE - 1);
+    if (next == reportTail) {
+        reportWaits++;
+        while (next == reportTail) {
+            paceReports();
         }
-        if ((entry[dir] & ME_SHIFT_MASK) != 0) {
-            Serial.print(F("s"));
-        }
-        if ((entry[dir] & ME_GUI_MASK) != 0) {
-            Serial.print(F("g"));
-        }
-        int8_t val = entry[dir] & ME_VALUE_MASK;
-        if (val >= 0) {
-            Serial.print(F("+"));
-        }
-        Serial.print(val);
-        Serial.print(F(" "));
+    }
+    hidReport &r = reportQueue[reportHead];
+    r.id = id;
+    r.len = len;
+    memcpy(r.data, data, len);
+    reportHead = next;
+    if (reportsQueued() > reportMostQueued) {
+        reportMostQueued = reportsQueued();
     }
 }
 
-// printConfigC(uint16_t entry[])  Format and print both parts of a mouse click entry
-void printConfigC(uint16_t entry[]) {
-    for (uint8_t dir = 0; dir < 2; dir++) {
-        if ((entry[dir] & ME_CTRL_MASK) != 0) {
-            Serial.print(F("c"));
-        }
-        if ((entry[dir] & ME_ALT_MASK) != 0){
-            Serial.print(F("a"));
+// Send a keyboard report with modifiers mods and (if not 0) the key whose HID usage is usage down
+void sendKeys(uint8_t mods, uint8_t usage) {
+    uint8_t report[8] = {mods, 0, usage, 0, 0, 0, 0, 0};
+    queueReport(HID_KEYBOARD_ID, report, sizeof(report));
+}
+
+// Send mouse reports with buttons down, moving the mouse and/or its wheel by amounts that may be too big 
+// for a single report, by sending as many reports as it takes
+void sendMouse(uint8_t buttons, int16_t x, int16_t y, int16_t wheel) {
+    do {
+        int8_t dx = constrain(x, -127, 127);
+        int8_t dy = constrain(y, -127, 127);
+        int8_t dw = constrain(wheel, -127, 127);
+        uint8_t report[4] = {buttons, (uint8_t)dx, (uint8_t)dy, (uint8_t)dw};
+        queueReport(HID_MOUSE_ID, report, sizeof(report));
+        x -= dx;
+        y -= dy;
+        wheel -= dw;
+    } while (x != 0 || y != 0 || wheel != 0);
+}
+
+// Send a consumer control report with the control whose usage is usage (if not 0) down
+void sendConsumer(uint16_t usage) {
+    uint8_t report[2] = {(uint8_t)usage, (uint8_t)(usage >> 8)};
+    queueReport(HID_CONSUMER_ID, report, sizeof(report));
+}
+
+// Send a high-resolution wheel report rolling the wheel by wheel HID_HIRES_CLICK-ths of a click
+void sendHiRes(int16_t wheel) {
+    uint8_t report[4] = {0, 0, (uint8_t)wheel, (uint8_t)(wheel >> 8)};
+    queueReport(HID_HIRES_ID, report, sizeof(report));
+}
+#endif
+
+// Play the action op op->reps times, multiplying its mouse move or wheel roll amounts by scale. The 
+// modifiers are only pressed and released once for all of them: a repeated key goes down and up with the 
+// modifiers held throughout, as does each mouse action.
+void playOp(const actionOp *op, int16_t scale) {
+    #ifdef __AVR_ATmega32U4__
+    if (op->type == opKey) {
+        for (uint8_t rep = 1; rep < op->reps; rep++) {
+            sendKeys(op->mods, op->code);
+            sendKeys(op->mods, 0);
         }
-        if ((entry[dir] & ME_SHIFT_MASK) != 0) {
-            Serial.print(F("s"));
+        sendKeys(op->mods, op->code);
+        sendKeys(0, 0);
+        return;
+    }
+    if (op->mods != 0) {
+        sendKeys(op->mods, 0);
+    }
+    for (uint8_t rep = 0; rep < op->reps; rep++) {
+        switch (op->type) {
+            case opWheel:
+                sendMouse(0, 0, 0, op->x * scale);
+                break;
+            case opMove:
+                if (op->code != 0) {
+                    sendMouse(op->code, 0, 0, 0);
+                }
+                sendMouse(op->code, op->x * scale, op->y * scale, 0);
+                if (op->code != 0) {
+                    sendMouse(0, 0, 0, 0);
+                }
+                break;
+            case opClick:
+                sendMouse(op->code, 0, 0, 0);
+                sendMouse(0, 0, 0, 0);
+                break;
+            case opHiRes:
+                sendHiRes(op->x * scale);
+                break;
+            case opConsumer:
+                sendConsumer(consumerUsage(*op));
+                sendConsumer(0);
+                break;
+            default:
+                break;
         }
-        if ((entry[dir] & ME_GUI_MASK) != 0) {
-            Serial.print(F("g"));
+    }
+    if (op->mods != 0) {
+        sendKeys(0, 0);
+    }
+    #else
+    Serial.print(opLetter(op->type));
+    Serial.print(op->mods, HEX);
+    Serial.print(F(":"));
+    Serial.print(op->code, HEX);
+    Serial.print(F(","));
+    Serial.print(op->x * scale);
+    Serial.print(F(","));
+    Serial.print(op->y * scale);
+    if (op->reps > 1) {
+        Serial.print(F("*"));
+        Serial.print(op->reps);
+    }
+    Serial.print(F(" "));
+    #endif
+}
+
+/****
+ * 
+ * Misc helper functions
+ * 
+ ****/
+
+// void printMods(uint8_t mods) Print modifier keys mods (as in actionOp.mods) in <k-modifiers> form
+void printMods(uint8_t mods) {
+    if ((mods & 0x01) != 0) {
+        Serial.print(F("c"));
+    }
+    if ((mods & 0x04) != 0) {
+        Serial.print(F("a"));
+    }
+    if ((mods & 0x02) != 0) {
+        Serial.print(F("s"));
+    }
+    if ((mods & 0x08) != 0) {
+        Serial.print(F("g"));
+    }
+}
+
+// void printButtons(uint8_t buttons) Print mouse buttons (MOUSE_*) in <m-modifiers> form
+void printButtons(uint8_t buttons) {
+    if ((buttons & MOUSE_LEFT) != 0) {
+        Serial.print(F("l"));
+    }
+    if ((buttons & MOUSE_MIDDLE) != 0) {
+        Serial.print(F("m"));
+    }
+    if ((buttons & MOUSE_RIGHT) != 0) {
+        Serial.print(F("r"));
+    }
+}
+
+// void printAmount(int8_t val) Print a mouse move or wheel roll amount in <signed-num> form
+void printAmount(int8_t val) {
+    if (val >= 0) {
+        Serial.print(F("+"));
+    }
+    Serial.print(val);
+}
+
+// void printOp(const actionOp &op) Format and print the action op (as it comes from a CB) as a <*-spec>
+void printOp(const actionOp &op) {
+    printMods(op.mods);
+    switch (op.type) {
+        case opKey:
+            if (isPrintable(op.code) && op.code > ' ' && op.code < 0x7F) {
+                Serial.print(F("\'"));
+                Serial.print((char)op.code);
+            } else {
+                Serial.print(op.code < 0x10 ? F("0x0") : F("0x"));
+                Serial.print(op.code, HEX);
+            }
+            break;
+        case opMove:
+            printButtons(op.code);
+            printAmount(op.x);
+            printAmount(op.y);
+            break;
+        case opWheel:
+        case opHiRes:
+            printAmount(op.x);
+            break;
+        case opClick:
+            printButtons(op.code);
+            break;
+        case opConsumer:
+            Serial.print(consumerUsage(op) < 0x10 ? F("0x0") : F("0x"));
+            Serial.print(consumerUsage(op), HEX);
+            break;
+    }
+    if (op.reps > 1) {
+        Serial.print(F("*"));
+        Serial.print(op.reps);
+    }
+    Serial.print(F(" "));
+}
+
+// bool popEvent(wheelEvent &e) Take the oldest event the ISR has queued in eventRing into e. Returns false 
+// if there is none. Only loop() may call this. It doesn't turn off interrupts: the ISR never changes 
+// eventTail or the slots between eventTail and eventHead, so all we need is for the compiler not to move 
+// getting the event to before checking eventHead or to after giving its slot back.
+bool popEvent(wheelEvent &e) {
+    uint8_t tail = eventTail;
+    if (tail == eventHead) {
+        return false;
+    }
+    __asm__ __volatile__ ("" ::: "memory");
+    e = eventRing[tail];
+    __asm__ __volatile__ ("" ::: "memory");
+    eventTail = (tail + 1) & (EVENT_RING_SIZE - 1);
+    return true;
+}
+
+// bool popButton(buttonEvent &e) Take the oldest button change the ISR has queued in buttonRing into e. 
+// Returns false if there is none. Only loop() may call this. (See popEvent().)
+bool popButton(buttonEvent &e) {
+    uint8_t tail = buttonTail;
+    if (tail == buttonHead) {
+        return false;
+    }
+    __asm__ __volatile__ ("" ::: "memory");
+    e = buttonRing[tail];
+    __asm__ __volatile__ ("" ::: "memory");
+    buttonTail = (tail + 1) & (BUTTON_RING_SIZE - 1);
+    return true;
+}
+
+// void calibrate() Set each wheel's coils' trigger and reset levels from its decoder's running averages of 
+// the coil's noise floor, its noise and its typical pulse peak, as levelsFor() works them out. Levels that 
+// have changed by more than CAL_SAVE_DELTA since they were saved are saved in the header, but not more often 
+// than every CAL_SAVE_MILLIS, to spare the EEPROM.
+void calibrate() {
+    static unsigned long saveMillis = 0;
+    bool changed = false;
+    for (uint8_t w = 0; w < WHEELS; w++) {
+        coilDecoder &d = dec[w];
+        for (uint8_t c = 0; c < 2; c++) {
+            uint16_t fl, noise, peak;
+            uint16_t trigger, reset;
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                fl = d.calFloor[c] >> CAL_SHIFT;
+                noise = d.calNoise[c];
+                peak = d.calPeak[c];
+            }
+            levelsFor(fl, noise, peak, trigger, reset);
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                d.triggerLevel[c] = trigger;
+                d.resetLevel[c] = reset;
+            }
+            if (abs((int16_t)trigger - header.trigger[w][c]) > CAL_SAVE_DELTA || 
+                    abs((int16_t)reset - header.reset[w][c]) > CAL_SAVE_DELTA) {
+                changed = true;
+            }
         }
-        if ((entry[dir] & ME3_LEFT_MASK) != 0){
-            Serial.print(F("l"));
+    }
+    if (changed && (saveMillis == 0 || millis() - saveMillis >= CAL_SAVE_MILLIS)) {
+        for (uint8_t w = 0; w < WHEELS; w++) {
+            for (uint8_t c = 0; c < 2; c++) {
+                header.trigger[w][c] = dec[w].triggerLevel[c];
+                header.reset[w][c] = dec[w].resetLevel[c];
+            }
         }
-        if ((entry[dir] & ME3_MID_MASK) != 0) {
-            Serial.print(F("m"));
+        writeHeader();
+        saveMillis = millis();
+    }
+}
+
+// void loadLevels() Set the wheels' coils' trigger and reset levels to the calibrated ones in header
+void loadLevels() {
+    for (uint8_t w = 0; w < WHEELS; w++) {
+        for (uint8_t c = 0; c < 2; c++) {
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                dec[w].triggerLevel[c] = header.trigger[w][c];
+                dec[w].resetLevel[c] = header.reset[w][c];
+            }
         }
-        if ((entry[dir] & ME3_RIGHT_MASK) != 0) {
-            Serial.print(F("r"));
+    }
+}
+
+// uint32_t allEdges() Return the number of coil edges all the wheels' decoders have seen
+uint32_t allEdges() {
+    uint32_t edges = 0;
+    for (uint8_t w = 0; w < WHEELS; w++) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            edges += dec[w].edges;
         }
-        Serial.print(F(" "));
     }
+    return edges;
+}
+
+// char nextChar(const char *&sp) Return the next character of the word sp points into and move sp past it. 
+// At the end of the word, return '\0' (and leave sp there).
+char nextChar(const char *&sp) {
+    return *sp != '\0' ? *sp++ : '\0';
+}
+
+// void getWord(uint8_t n, char *word) Copy word n of the command line into word, a CLI_WORD_SIZE buffer. 
+// (UserInput only hands out words as Strings, so this is the one place one gets made. It's gone again 
+// before we return, so nothing else holds heap while we parse.)
+void getWord(uint8_t n, char *word) {
+    ui.getWord(n).toCharArray(word, CLI_WORD_SIZE);
 }
 
 // parseK() -- Parse keyboard spec
-uint16_t parseK(String spec) {
-    String sp = spec;
+uint16_t parseK(const char *spec) {
+    const char *sp = spec;
     uint16_t answer = 0;        // Keyboard entry (no flags in most-significant nibble)
     char nc;
     bool bad = false;
     for (int8_t i = 0; i < 5; i++) {
-        nc = sp.charAt(0);
-        sp.remove(0, 1);
+        nc = nextChar(sp);
         if (nc == 'C' || nc == 'c') {
             answer |= KB_CTRL_MASK;
         } else if (nc == 'A' || nc == 'a') {
@@ -710,8 +2097,7 @@ uint16_t parseK(String spec) {
         }
     }
     if (nc == '\'') {
-        nc = sp.charAt(0);
-        sp.remove(0, 1);
+        nc = nextChar(sp);
         if (!isPrintable(nc)) {
             bad = true;
             Serial.print(F("Invalid character value in"));
@@ -719,19 +2105,18 @@ uint16_t parseK(String spec) {
         answer |= (nc & 0x7F);
         answer = answer & ~KB_SHIFT_MASK; // Clear shift mod for printable chars
     } else if (nc == '0') {
-        nc = sp.charAt(0);
-        sp.remove(0, 1);
+        nc = nextChar(sp);
         uint8_t val;
-        if ((nc == 'x' || nc == 'X') && sp.length() == 2) {
-            char hh = sp.charAt(0);
-            char hl = sp.charAt(1);
+        if ((nc == 'x' || nc == 'X') && strlen(sp) == 2) {
+            char hh = sp[0];
+            char hl = sp[1];
             if (!isHexadecimalDigit(hh) || !isHexadecimalDigit(hl)) {
                 bad = true;
                 Serial.print(F("Invalid hex number in"));
                 val = 0;
             } else {
-                hh = hh <= '9' ? hh - '0' : hh < 'F' ? hh - 'A' + 10 : hh - 'a' + 10;
-                hl = hl <= '9' ? hl - '0' : hl < 'F' ? hl - 'A' + 10 : hl - 'a' + 10;
+                hh = hh <= '9' ? hh - '0' : hh <= 'F' ? hh - 'A' + 10 : hh - 'a' + 10;
+                hl = hl <= '9' ? hl - '0' : hl <= 'F' ? hl - 'A' + 10 : hl - 'a' + 10;
                 val = (hh << 4) + hl;
             }            
         } else {
@@ -744,7 +2129,7 @@ uint16_t parseK(String spec) {
         Serial.print(F("Invalid"));
     }
     if (bad) {
-        Serial.print(" keyboard spec: ");
+        Serial.print(F(" keyboard spec: "));
         Serial.println(spec);
         return 0;
     }
@@ -757,16 +2142,15 @@ uint16_t parseK(String spec) {
 }
 
 // parseM() -- Parse mouse movement spec
-uint32_t parseM(String spec) {
+uint32_t parseM(const char *spec) {
     uint16_t answer[2] = {CE_TYPE_MASK, CE_TYPE_MASK};
     SET_ME_TYPE(answer[0], ME_TYPE_X);      // Type 1 mouse entries
     SET_ME_TYPE(answer[1], ME_TYPE_Y);
-    String sp = spec;
+    const char *sp = spec;
     char nc;
     bool bad = false;
     for (int8_t i = 0; i < 8; i++) {
-        nc = sp.charAt(0);
-        sp.remove(0, 1);
+        nc = nextChar(sp);
         if (nc == 'C' || nc == 'c') {
             answer[1] |= ME_CTRL_MASK;
         } else if (nc == 'A' || nc == 'a') {
@@ -795,33 +2179,31 @@ uint32_t parseM(String spec) {
             bad = true;
             Serial.print(F("Invalid"));
         }
-        nc = sp.charAt(0);
-        sp.remove(0, 1);
+        nc = nextChar(sp);
         if (!isdigit(nc)) {
             bad = true;
             Serial.print(F("Distance missing in"));
         }
-        int8_t val = 0;
+        uint16_t val = 0;
         for (uint8_t digit = 0; !bad && digit < 3; digit++) {
             val = val * 10 + (nc - '0');
-            nc = sp.charAt(0);
-            sp.remove(0, 1);
+            nc = nextChar(sp);
             if (!isdigit(nc)) {
                 break;
             }
         }
         if (!bad) {
-            if (val > 255) {
+            if (val > 127) {
                 bad = true;
                 Serial.print(F("Distance, "));
                 Serial.print(val);
-                Serial.print(F(", must be <= 255. in"));
+                Serial.print(F(", must be <= 127. in"));
             } else {
                 answer[ap] |= (isPos ? val : -val) & ME_VALUE_MASK;
             }
         }
         if (bad) {
-            Serial.print(" mouse spec: ");
+            Serial.print(F(" mouse spec: "));
             Serial.println(spec);
             return 0;
         }
@@ -837,14 +2219,13 @@ uint32_t parseM(String spec) {
 }
 
 // parseW() parse mouse wheel-roll spec
-uint16_t parseW(String spec) {
-    String sp = spec;
+uint16_t parseW(const char *spec) {
+    const char *sp = spec;
     uint16_t answer = CE_TYPE_MASK;     //Type 0 (wheel) mouse entry
     char nc;
     bool bad = false;
     for (int8_t i = 0; i < 5; i++) {
-        nc = sp.charAt(0);
-        sp.remove(0, 1);
+        nc = nextChar(sp);
         if (nc == 'C' || nc == 'c') {
             answer |= KB_CTRL_MASK;
         } else if (nc == 'A' || nc == 'a') {
@@ -866,33 +2247,31 @@ uint16_t parseW(String spec) {
         bad = true;
         Serial.print(F("Invalid"));
     }
-    nc = sp.charAt(0);
-    sp.remove(0, 1);
+    nc = nextChar(sp);
     if (!isdigit(nc)) {
         bad = true;
         Serial.print(F("Wheel amount missing in"));
     }
-    int8_t val = 0;
+    uint16_t val = 0;
     for (uint8_t digit = 0; !bad && digit < 3; digit++) {
         val = val * 10 + (nc - '0');
-        nc = sp.charAt(0);
-        sp.remove(0, 1);
+        nc = nextChar(sp);
         if (!isdigit(nc)) {
             break;
         }
     }
     if (!bad) {
-        if (val > 255) {
+        if (val > 127) {
             bad = true;
             Serial.print(F("Wheel amount, "));
             Serial.print(val);
-            Serial.print(F(", must be <= 255. in"));
+            Serial.print(F(", must be <= 127. in"));
         } else {
             answer |= (isPos ? val : -val) & ME_VALUE_MASK;
         }
     }
     if (bad) {
-        Serial.print(" wheel spec: ");
+        Serial.print(F(" wheel spec: "));
         Serial.println(spec);
         return 0;
     }
@@ -905,15 +2284,14 @@ uint16_t parseW(String spec) {
 }
 
 // parseC() parse mouse wheel-roll spec
-uint16_t parseC(String spec) {
-    String sp = spec;
+uint16_t parseC(const char *spec) {
+    const char *sp = spec;
     bool bad = false;
     uint16_t answer = CE_TYPE_MASK;     //Type 2 (click) mouse entry
     SET_ME_TYPE(answer, ME_TYPE_CLICK);
     char nc;
     for (int8_t i = 0; i < 5; i++) {
-        nc = sp.charAt(0);
-        sp.remove(0, 1);
+        nc = nextChar(sp);
         if (nc == 'C' || nc == 'c') {
             answer |= KB_CTRL_MASK;
         } else if (nc == 'A' || nc == 'a') {
@@ -943,12 +2321,11 @@ uint16_t parseC(String spec) {
                 Serial.print(nc);
                 break;
             }
-            nc = sp.charAt(0);
-            sp.remove(0, 1);
+            nc = nextChar(sp);
         }
     }
     if (bad) {
-        if (spec.length() != 0) {
+        if (spec[0] != '\0') {
             Serial.print(F(" in: "));
             Serial.println(spec);
         } else {
@@ -964,10 +2341,81 @@ uint16_t parseC(String spec) {
     return answer;
 }
 
-// uint8_t toCbn(String token) Convert token to configuration block number. Returns N_CONFGS if toke is not a valid integer in the required range
-uint8_t toCbn(String token) {
-    uint8_t n = token.toInt();
-    if (!isDigit(token.charAt(0)) || token.length() == 0 || n < 0 || n >= N_ELEMENTS(header.configPtr) || header.configPtr[n] == 0) {
+// char beginOp(const char *&sp, opType_t type, actionOp &op) Start op as an action of kind type with the 
+// <k-modifiers> at sp, moving sp past them. Returns the character after them. (High-resolution wheel rolls 
+// and consumer controls don't fit in a configuration entry, so parseH() and parseU() make the actionOp 
+// themselves.)
+char beginOp(const char *&sp, opType_t type, actionOp &op) {
+    op.type = type;
+    op.mods = 0;
+    op.code = 0;
+    op.x = 0;
+    op.y = 0;
+    op.reps = 1;
+    while (true) {
+        char nc = nextChar(sp);
+        uint8_t mod = nc == 'C' || nc == 'c' ? 0x01 : nc == 'S' || nc == 's' ? 0x02 : 
+                      nc == 'A' || nc == 'a' ? 0x04 : nc == 'G' || nc == 'g' ? 0x08 : 0;
+        if (mod == 0) {
+            return nc;
+        }
+        op.mods |= mod;
+    }
+}
+
+// bool parseH(const char *spec, actionOp &op) Parse high-resolution wheel-roll spec spec into op. Returns 
+// false, having said what's wrong, if it doesn't make sense.
+bool parseH(const char *spec, actionOp &op) {
+    const char *sp = spec;
+    char nc = beginOp(sp, opHiRes, op);
+    bool isPos = nc == '+';
+    int16_t val = 0;
+    uint8_t digits = 0;
+    if (nc == '+' || nc == '-') {
+        for (nc = nextChar(sp); isDigit(nc) && digits < 4; nc = nextChar(sp)) {
+            val = val * 10 + (nc - '0');
+            digits++;
+        }
+    }
+    if (digits == 0 || nc != '\0' || val > 127) {
+        Serial.print(F("Amount not -127..+127 in high-resolution wheel spec: "));
+        Serial.println(spec);
+        return false;
+    }
+    op.x = isPos ? val : -val;
+    return true;
+}
+
+// bool parseU(const char *spec, actionOp &op) Parse consumer control spec spec into op. Returns false, 
+// having said what's wrong, if it doesn't make sense.
+bool parseU(const char *spec, actionOp &op) {
+    const char *sp = spec;
+    char nc = beginOp(sp, opConsumer, op);
+    uint16_t usage = 0;
+    uint8_t digits = 0;
+    if (nc == '0') {
+        nc = nextChar(sp);
+        if (nc == 'x' || nc == 'X') {
+            for (nc = nextChar(sp); isHexadecimalDigit(nc) && digits < 4; nc = nextChar(sp)) {
+                usage = usage << 4 | (nc <= '9' ? nc - '0' : nc <= 'F' ? nc - 'A' + 10 : nc - 'a' + 10);
+                digits++;
+            }
+        }
+    }
+    if (digits == 0 || nc != '\0' || usage == 0 || usage > CB_MAX_USAGE) {
+        Serial.print(F("Usage not 0x001..0x7FF in consumer control spec: "));
+        Serial.println(spec);
+        return false;
+    }
+    op.code = usage & 0xFF;
+    op.y = usage >> 8;
+    return true;
+}
+
+// uint8_t toCbn(const char *token) Convert token to configuration block number. Returns N_CONFGS if toke is not a valid integer in the required range
+uint8_t toCbn(const char *token) {
+    int n = atoi(token);
+    if (!isDigit(token[0]) || n < 0 || n >= N_ELEMENTS(header.configPtr) || header.configPtr[n] == 0) {
         return N_ELEMENTS(header.configPtr);
     }
     return n;
@@ -975,232 +2423,1164 @@ uint8_t toCbn(String token) {
 
 /****
  * 
- * ui command handlers
+ * RAM usage
+ * 
+ * Between the heap (which grows up from the end of the globals) and the 
+ * stack (which grows down from RAMEND) is the free RAM. At reset, before 
+ * the globals are initialized, paintStack() fills everything from the 
+ * start of the heap to RAMEND with STACK_PAINT. Any byte the stack has 
+ * ever reached has, almost certainly, been overwritten with something 
+ * else, so counting the painted bytes just above the top of the heap tells 
+ * how close the stack has come to the heap since reset. (A byte pushed 
+ * that happens to be STACK_PAINT makes the count a little optimistic; 
+ * heap freed back to below where it was makes it pessimistic.)
  * 
  ****/
 
-// Unknown
-void onUnknown() {
-    Serial.println(F("Unknown or unimplemented command."));
+// void paintStack() Fill the free RAM with STACK_PAINT. Runs (in .init3) after the stack pointer is set 
+// up and before the globals are. It's not called; the startup code just runs into it.
+void paintStack() __attribute__((naked, used, section(".init3")));
+void paintStack() {
+    for (uint8_t *p = (uint8_t *)&__heap_start; p <= (uint8_t *)RAMEND; p++) {
+        *p = STACK_PAINT;
+    }
 }
 
-// help | h [new] Displays list of commands
-void onHelp() {
-    if (ui.getWord(1).equals("new")) {
-        Serial.println(F("JogWheel new command help\n"
-                         "To make a new configuration, type \"new <config>\" where\n"
-                         "  <config> = <spec> ( <spec>)*\n"
-                         "There can be up to 32 specs per configuration (16 for mouse moves), separated by whitespace.\n"
-                         "  <spec> = (K|k)<k-spec> <k-spec> | (M|m)<m-spec> <m-spec> | (W|w)<w-spec> <w-spec> | (C|c)<c-spec> <c-spec>\n"
-                         "The first <*-spec> in a pair tells what to do on a clockwise click of the jogwheel. The other does the same for counterclockwise.\n"
-                         "K means the action is a keystroke, M means a mouse movement spec, W means a mouse wheel roll, and C means a mouse click.\n"
-                         "  <k-spec> = <k-modifiers><keystroke>\n"
-                         "  <m-spec> = <k-modifiers><m-modifiers><x-dist><y-dist>\n"
-                         "  <w-spec> = <k-modifiers><m-modifiers><wheel-amt>\n"
-                         "  <c-spec> = <k-modifiers><m-button>\n"
-                         "  <k-modifiers> = [(c|C)][(a|A)][(s|S)][(g|G)]\n"
-                         "  <m-modifiers> = [(l|L)][(m|M)][(r|R)]\n"
-                         "  <keystroke> = \'<printable-char> | (0X|0x)<hex-digit><hex-digit>\n"
-                         "  <x-dist> = <signed-num>\n"
-                         "  <y-dist> = <signed-num>\n"
-                         "  <m-button> = (l|L)|(m|M)|(r|R)\n"
-                         "  <signed-num> = (+|-)[<dec-digit>][<dec-digit>]<dec-digit> (whose value must be -255..+255)\n"
-                         "  <dec-digit> = (0..9)\n"
-                         "  <hex-digit> = (0..9)|(A..F)|(a..f)\n"
-                         "  <printable-char> = a printable ascii character, including \'\n"
-                         "For example, \"k0xDA 0xD9\" is the default config."));
-    } else {
-        Serial.println(F("JogWheel command list:\n"
-                         "  help [new]      Display this list of commands or the help for the new command\n"
-                         "  h [new]         Same as help\n"
-                         "  display         Display a list of the configurations\n"
-                         "  d               Same as display\n"
-                         "  new <config>    Specify a new configuration. (Type \"help new\" for help)\n"
-                         "  n <config>      Same as new\n"
-                         "  use <c> <n>     Use configuration <n> for button combo <c>. <c> = 0: all up .. c = 7: all down\n"
-                         "  u <c> <n>       Same as use\n"
-                         "  remove <n>      Remove configuration <n>, 1 <= <n> <= 7\n"
-                         "  r <n>           Same as remove"));
+// uint8_t *heapTop() Return the address just past the top of the heap
+uint8_t *heapTop() {
+    return (uint8_t *)(__brkval == 0 ? &__heap_start : __brkval);
+}
+
+// uint16_t ramFree() Return the number of bytes between the top of the heap and the stack right now
+uint16_t ramFree() {
+    return (uint8_t *)SP - heapTop() + 1;
+}
+
+// uint16_t ramLowWater() Return the fewest bytes there have been between the heap and the stack since reset
+uint16_t ramLowWater() {
+    uint8_t *p = heapTop();
+    while (p <= (uint8_t *)RAMEND && *p == STACK_PAINT) {
+        p++;
     }
+    return p - heapTop();
 }
 
-// display | d  Display the list of available configurations
-void onDisplay() {
-    Serial.println(F("Button combination to configuraton map"));
-    Serial.println(F("Combo  Color   Config Number"));
-    for (uint8_t i = 0; i < N_ELEMENTS(header.curConfig); i++){
-        Serial.print(F("    "));
-        Serial.print(i + 1);
-        Serial.print(F("  "));
-        Serial.print(ledColor[i]);
-        Serial.print(F(" "));
-        Serial.println(header.curConfig[i]);
+/****
+ * 
+ * LED
+ * 
+ * The LED's color says which configuration is selected (or, while a chord 
+ * is being entered, which one will be). The red and green parts are simply 
+ * on or off, but the blue part is driven by hardware PWM, so it can also 
+ * say how the wheel is doing. As the wheel turns faster, ledTask() fades 
+ * the blue part away from where the color has it -- in for colors without 
+ * blue, out for those with it -- all the way at LED_FULL_RATE detents per 
+ * second. If the ISR has had to wait for room in eventRing, i.e., the 
+ * wheel is being spun faster than its actions can be sent, the blue part 
+ * blinks instead, until LED_WARN_MILLIS after the last time.
+ * 
+ * Pin 6 is the only one of the LED's pins with a PWM output that isn't on 
+ * Timer 1, which the ADC ISR has taken over: on the Leonardo it's Timer 4's 
+ * OC4D, on the Uno Timer 0's OC0A. The Arduino core already has both timers 
+ * running in a PWM mode (Timer 0 for millis()), so all it takes is 
+ * connecting the output and setting the duty cycle. The timer does the 
+ * rest; the CPU never toggles the pin.
+ * 
+ ****/
+
+// void ledBlue(uint8_t duty) Set the duty cycle of the LED's blue part: 0 (off)..255 (on). Fully off and 
+// fully on are done with the port bit, since in PWM, 0 and 255 can still leave a sliver of a pulse.
+void ledBlue(uint8_t duty) {
+    if (duty == 0 || duty == 0xFF) {
+        LED_PWM_TCCR &= ~LED_PWM_COM;
+        fastPin<LED_B>::write(duty != 0);
+    } else {
+        LED_PWM_OCR = duty;
+        LED_PWM_TCCR |= LED_PWM_COM;
     }
-    Serial.println(F("Configuration number to <config> map"));
-    Serial.println(F("Number  <config>"));
-    for (uint8_t cbn = 0; cbn < N_ELEMENTS(header.configPtr) && header.configPtr[cbn] != 0; cbn++) {
-        configBlock cb;
-        Serial.print(F("     "));
-        Serial.print(cbn);
-        Serial.print(F("  "));
-        readConfig(cbn, cb);
-        for (int8_t enN = 0; enN < cb.nEntries; enN++) {
-            uint16_t entryA[2] = {cb.entry[enN][0], cb.entry[enN][1]};
-            uint16_t entryB[2];
-            char eType;
-            if ((entryA[0] & CE_TYPE_MASK) == 0) {
-                eType = 'k';
-            }else {
-                uint8_t meType = ME_TYPE(entryA[0]);
-                eType = meType == ME_TYPE_CLICK ? 'c' : meType == ME_TYPE_WHEEL ? 'w' : 'm';
-            }
-            Serial.print(eType);
-            switch (eType) {
-                case 'k':
-                    printConfigK(entryA);
-                    break;
-                case 'm':
-                    if (enN >= cb.nEntries) {
-                        Serial.print("Invalid move entry! enN: ");
-                        Serial.print(enN);
-                        break;
-                    }
-                    enN++;
-                    entryB[0] = cb.entry[enN][0];
-                    entryB[1] = cb.entry[enN][1];
-                    printConfigM(entryA, entryB);
-                    break;
-                case 'w':
-                    printConfigW(entryA);
-                    break;
-                case 'c':
-                    printConfigC(entryA);
-                    break;
-                default:
-                    Serial.print(F("Unrecognized type of configuration entry: "));
-                    Serial.println(eType);
-            }
-        }
-        Serial.print(F("\n"));
+}
+
+// void ledUpdate() Set the LED's blue part for ledShown, ledActivity and ledWarning
+void ledUpdate() {
+    uint8_t rest = (ledShown & LED_BLUE) != 0 ? 0xFF : 0x00;
+    if (ledWarning) {
+        ledBlue((millis() / LED_BLINK_MILLIS & 1) != 0 ? ~rest : rest);
+    } else {
+        ledBlue(rest ^ ledActivity);
     }
-    Serial.print(F("There are "));
-    Serial.print(freeSpace());
-    Serial.println(F(" bytes free for configurations."));
 }
 
-// new | n <config> Add the new configuration <config> to the list of available configurations
-void onNew() {
-    configBlock cb;
-    cb.nEntries = 0;
-    bool bad = false;
-    uint8_t eNum = 0;
-    while (cb.nEntries < sizeof(cb.entry) / sizeof(cb.entry[0])) {
-        String spec[2];
-        spec[0] = ui.getWord(1 + 2*eNum);
-        spec[1] = ui.getWord(2 + 2*eNum);
-        eNum++;
-        if (spec[0].length() == 0) {
+// void ledShow(uint8_t color) Show color (bit 0 red, 1 green, 2 blue; an index into ledColor[] + 1) on the LED
+void ledShow(uint8_t color) {
+    ledShown = color;
+    ledPins::write(color);
+    ledUpdate();
+}
+
+/****
+ * 
+ * Binary configuration protocol
+ * 
+ * For provisioning tools, there's a binary alternative to the command line. 
+ * The "binary" command switches the serial port to it, after which loop() 
+ * hands what arrives to binaryRun() instead of ui. Requests and responses 
+ * are frames:
+ * 
+ *   BIN_SYNC, cmd, len, len bytes of payload, crc (lo), crc (hi)
+ * 
+ * where crc is the CRC-16/CCITT (as in _crc_ccitt_update(), starting from 
+ * 0xFFFF) of cmd, len and the payload. Each request gets exactly one 
+ * response, with the same cmd and a payload that starts with a status byte. 
+ * A request with a bad CRC gets a BIN_BAD_CRC response; if no byte arrives 
+ * for BIN_TIMEOUT_MILLIS in the middle of a request, what's arrived so far 
+ * is dropped. Everything is done straight from and to the header and 
+ * EEPROM, with none of the String handling or parsing of the command line. 
+ * (The details are in "Binary Protocol.txt".)
+ * 
+ * Nothing stops a tool from writing nonsense to EEPROM with 
+ * BIN_WRITE_EEPROM, but nothing uses what's written until a BIN_WRITE_HEADER 
+ * (which checks the header and the CBs it points to before using them) or a 
+ * BIN_RELOAD.
+ * 
+ * A host program that follows which application has the focus can stay in 
+ * binary mode and switch configurations as the focus moves: BIN_SELECT 
+ * selects a button combo, as a chord would, and BIN_LOAD_PLAN has a wheel 
+ * play a CB sent with the request. Neither one writes EEPROM or waits for 
+ * the writes queued to it. BIN_LOAD_PLAN doesn't read EEPROM at all. 
+ * BIN_SELECT reads the selected CBs, which takes a fraction of a 
+ * millisecond unless the EEPROM is in the middle of writing a byte (of the 
+ * header or a selection slot), in which case it waits for that one byte, 
+ * ~3.3ms at most. What they do lasts until the 
+ * next chord, selection or reload; after a reset, the jogwheel is back to 
+ * the last selection made with the buttons.
+ * 
+ ****/
+
+// Send a response frame for command cmd with status status followed by the len bytes at data
+void binaryRespond(uint8_t cmd, uint8_t status, const void *data, uint8_t len) {
+    uint8_t frameHead[4] = {BIN_SYNC, cmd, (uint8_t)(len + 1), status};
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i = 1; i < sizeof(frameHead); i++) {
+        crc = _crc_ccitt_update(crc, frameHead[i]);
+    }
+    for (uint8_t i = 0; i < len; i++) {
+        crc = _crc_ccitt_update(crc, ((const uint8_t*)data)[i]);
+    }
+    Serial.write(frameHead, sizeof(frameHead));
+    Serial.write((const uint8_t*)data, len);
+    Serial.write(crc & 0xFF);
+    Serial.write(crc >> 8);
+}
+
+// Return whether every CB in header is in bounds, doesn't overlap another and decodes cleanly, whether 
+// the combos all map to existing CBs, and whether the acceleration levels are valid
+bool headerValid() {
+    uint8_t n = nConfigs();
+    if (header.fingerprint != FINGERPRINT || header.configPtr[0] == 0) {
+        return false;
+    }
+    for (uint8_t w = 0; w < WHEELS; w++) {
+        for (uint8_t combo = 0; combo < N_ELEMENTS(header.curConfig[w]); combo++) {
+            if (header.curConfig[w][combo] >= n) {
+                return false;
+            }
+        }
+    }
+    for (uint8_t cbn = 0; cbn < N_ELEMENTS(header.configPtr); cbn++) {
+        if (cbn >= n) {
+            if (header.configPtr[cbn] != 0) {
+                return false;
+            }
+            continue;
+        }
+        if (header.configPtr[cbn] < sizeof(header) || header.configPtr[cbn] + header.configSize[cbn] > SEL_SLOT_ADDR || 
+                header.configSize[cbn] == 0 || header.accel[cbn] > ACCEL_MAX_LEVEL) {
+            return false;
+        }
+        for (uint8_t other = 0; other < cbn; other++) {
+            if (header.configPtr[other] < header.configPtr[cbn] + header.configSize[cbn] && 
+                    header.configPtr[cbn] < header.configPtr[other] + header.configSize[other]) {
+                return false;
+            }
+        }
+        cbReader r;
+        actionOp op[2];
+        uint8_t nPairs = 0;
+        eeHold();
+        openConfig(cbn, r);
+        while (getPair(r, op[ENTRY_CW], op[ENTRY_CC])) {
+            nPairs++;
+        }
+        eeRelease();
+        if (r.bad || nPairs > PLAN_MAX_OPS) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Carry out the binary protocol request cmd whose len byte payload is at payload
+void binaryRequest(uint8_t cmd, const uint8_t *payload, uint8_t len) {
+    uint16_t addr = len >= 2 ? payload[0] | payload[1] << 8 : 0;
+    switch (cmd) {
+        case BIN_INFO: {
+            uint16_t info[3] = {FINGERPRINT, E2END + 1, sizeof(header)};
+            binaryRespond(cmd, BIN_OK, info, sizeof(info));
             break;
         }
-        if (spec[1].length() == 0) {
-            bad = true;
-            Serial.println(F("Missing last <spec-cc>."));
+        case BIN_READ_HEADER:
+            binaryRespond(cmd, BIN_OK, &header, sizeof(header));
+            break;
+        case BIN_WRITE_HEADER: {
+            if (len != sizeof(header)) {
+                binaryRespond(cmd, BIN_BAD_LENGTH, NULL, 0);
+                break;
+            }
+            headerBlock oldHeader = header;
+            memcpy(&header, payload, sizeof(header));
+            if (!headerValid()) {
+                header = oldHeader;
+                binaryRespond(cmd, BIN_BAD_HEADER, NULL, 0);
+                break;
+            }
+            writeHeader();
+            loadActiveConfig();
+            loadLevels();
+            binaryRespond(cmd, BIN_OK, NULL, 0);
+            break;
         }
-        uint16_t entry = 0;
-        uint32_t doubleEntry = 0;
-        uint8_t st = spec[0].charAt(0);
-        spec[0].remove(0, 1);
-        if (st == 'M' || st == 'm') {
-            if (cb.nEntries + 1 >= (uint8_t)(sizeof(cb.entry) / sizeof(cb.entry[0]))) {
-                bad = true;
-                Serial.println(F("Too many entries for a config."));
+        case BIN_READ_EEPROM: {
+            uint8_t data[BIN_MAX_DATA];
+            if (len != 3 || payload[2] > BIN_MAX_DATA || addr + payload[2] > E2END + 1) {
+                binaryRespond(cmd, BIN_BAD_LENGTH, NULL, 0);
+                break;
             }
-            for (uint8_t dir = 0; dir < 2; dir++) {
-                doubleEntry = parseM(spec[dir]);
-                if (doubleEntry == 0) {
-                    bad = true;
-                } else {
-                    #ifdef DEBUG
-                    Serial.print(F("parseM -- double entry: 0x"));
-                    Serial.print(doubleEntry, HEX);
-                    Serial.print(F(", cb.nEntries: "));
-                    Serial.print(cb.nEntries);
-                    Serial.print(F(", dir: "));
-                    Serial.println(dir);
-                    #endif
-                    cb.entry[cb.nEntries][dir] = doubleEntry >> 16;
-                    cb.entry[cb.nEntries + 1][dir] = doubleEntry & 0xFFFF;
-                }
+            eeSync();
+            eeprom_read_block(data, (const void*)addr, payload[2]);
+            binaryRespond(cmd, BIN_OK, data, payload[2]);
+            break;
+        }
+        case BIN_WRITE_EEPROM:
+            if (len < 2 || addr + (len - 2) > E2END + 1) {
+                binaryRespond(cmd, BIN_BAD_LENGTH, NULL, 0);
+                break;
+            }
+            eeSync();
+            eeprom_update_block(payload + 2, (void*)addr, len - 2);
+            binaryRespond(cmd, BIN_OK, NULL, 0);
+            break;
+        case BIN_RELOAD:
+            readHeader();
+            loadActiveConfig();
+            loadLevels();
+            binaryRespond(cmd, BIN_OK, NULL, 0);
+            break;
+        case BIN_EXIT:
+            binaryRespond(cmd, BIN_OK, NULL, 0);
+            binaryMode = false;
+            break;
+        case BIN_SELECT:
+            if (len != 1 || payload[0] >= N_ELEMENTS(header.curConfig[0])) {
+                binaryRespond(cmd, BIN_BAD_LENGTH, NULL, 0);
+                break;
             }
-            if (!bad) {
-                cb.nEntries += 2;
+            selection = payload[0];
+            loadActiveConfig();
+            ledShow(selection + 1);
+            binaryRespond(cmd, BIN_OK, NULL, 0);
+            break;
+        case BIN_LOAD_PLAN: {
+            cbReader r;
+            actionOp op[2];
+            uint8_t nPairs = 0;
+            if (len < 3 || payload[0] >= WHEELS) {
+                binaryRespond(cmd, BIN_BAD_LENGTH, NULL, 0);
+                break;
             }
-        } else {
-            for (uint8_t dir = 0; dir < 2; dir ++) {
-                if (st == 'K' || st == 'k') {
-                    entry = parseK(spec[dir]);
-                } else if (st == 'W' || st == 'w') {
-                    entry = parseW(spec[dir]);
-                } else if (st == 'C' || st == 'c') {
-                    entry = parseC(spec[dir]);
-                } else {
-                    Serial.print(F("Invalid <spec> type: \'"));
-                    Serial.print((char)st);
-                    Serial.println(F("\'. Must be \'k\', \'m\', \'w'\' or \'c\'."));
-                }
-                if (entry == 0) {
-                    bad = true;
-                } else {
-                    cb.entry[cb.nEntries][dir] = entry;
-                }
+            openRamConfig(payload + 2, len - 2, r);
+            while (getPair(r, op[ENTRY_CW], op[ENTRY_CC])) {
+                nPairs++;
             }
-            if (!bad) {
-                cb.nEntries++;
+            if (r.bad || nPairs > PLAN_MAX_OPS || payload[1] > ACCEL_MAX_LEVEL) {
+                binaryRespond(cmd, BIN_BAD_HEADER, NULL, 0);
+                break;
             }
+            stopPlaying(player);
+            openRamConfig(payload + 2, len - 2, r);
+            loadPlan(plan[payload[0]], r, true, payload[1]);
+            binaryRespond(cmd, BIN_OK, NULL, 0);
+            break;
         }
-        if (bad) {
+        default:
+            binaryRespond(cmd, BIN_BAD_CMD, NULL, 0);
+            break;
+    }
+}
+
+// Deal with whatever has arrived on the serial port in binary mode. Called from loop().
+void binaryRun() {
+    static uint8_t frame[2 + BIN_MAX_PAYLOAD + 2];  // cmd, len, payload, crc (lo), crc (hi) of the request under way
+    static uint8_t pos = 0;                         // How many bytes of the frame have arrived. 0 ==> waiting for BIN_SYNC
+    static bool synced = false;                     // BIN_SYNC has arrived
+    static unsigned long lastMillis = 0;            // millis() when the last byte arrived
+    if (synced && millis() - lastMillis > BIN_TIMEOUT_MILLIS) {
+        synced = false;
+    }
+    while (Serial.available() > 0) {
+        uint8_t b = Serial.read();
+        lastMillis = millis();
+        if (!synced) {
+            synced = b == BIN_SYNC;
+            pos = 0;
+            continue;
+        }
+        frame[pos++] = b;
+        if (pos == 2 && frame[1] > BIN_MAX_PAYLOAD) {
+            binaryRespond(frame[0], BIN_BAD_LENGTH, NULL, 0);
+            synced = false;
+        } else if (pos >= 2 && pos == frame[1] + 4) {
+            uint16_t crc = 0xFFFF;
+            for (uint8_t i = 0; i < pos - 2; i++) {
+                crc = _crc_ccitt_update(crc, frame[i]);
+            }
+            synced = false;
+            if ((crc & 0xFF) != frame[pos - 2] || crc >> 8 != frame[pos - 1]) {
+                binaryRespond(frame[0], BIN_BAD_CRC, NULL, 0);
+            } else {
+                binaryRequest(frame[0], frame + 2, frame[1]);
+            }
+            if (!binaryMode) {
+                return;
+            }
+        }
+    }
+}
+
+/****
+ * 
+ * Capture mode
+ * 
+ * To see what the coils actually do (e.g., to work out the levels for a 
+ * new motor), the "capture" command streams every raw sample the ADC takes 
+ * over the serial port until anything arrives there. The ISR fills 
+ * capBlock[] (see the ADC ISR) and captureRun(), called from loop() 
+ * instead of ui, sends each one as it fills. The blocks go out just as 
+ * they are in RAM (the details are in "Capture Stream.txt"), so there's no 
+ * formatting to slow things down; at the full sample rate it's ~36KB/s, 
+ * which USB keeps up with easily. (A UART at 9600 baud doesn't, so most 
+ * blocks are dropped on an Uno.) The wheel keeps working while capturing.
+ * 
+ ****/
+
+// Send the next capture block once the ISR has filled it, and stop capturing when anything arrives on the 
+// serial port (or, on a Leonardo, the serial port is closed). Called from loop().
+void captureRun() {
+    if (Serial.available() > 0 || !Serial) {
+        capturing = false;
+        while (Serial.available() > 0) {
+            Serial.read();
+        }
+        Serial.println(F("\nCapture stopped."));
+        return;
+    }
+    if (capFull[capSend]) {
+        __asm__ __volatile__ ("" ::: "memory");
+        Serial.write((const uint8_t *)&capBlock[capSend], sizeof(captureBlock));
+        __asm__ __volatile__ ("" ::: "memory");
+        capFull[capSend] = false;
+        capSend ^= 1;
+    }
+}
+
+/****
+ * 
+ * Tasks
+ * 
+ * What loop() does is split into tasks, each of which does a bounded 
+ * amount of work and returns, so that none of them can hold up the others 
+ * for long. In priority order, they are:
+ * 
+ *   wheelTask()    Turn the detents the ISR has queued for each wheel into HID reports, and send them
+ *   buttonTask()   Debounce the buttons and act on button chords
+ *   calTask()      Keep the coil levels calibrated and decide when we're idle
+ *   uiTask()       Run the command line (or binary protocol or capture)
+ *   ledTask()      Show on the LED how fast the wheel's turning
+ * 
+ * loop() gives wheelTask() a turn before each of the others, which take 
+ * turns in order, so a long sequence of actions is played PLAY_SLICE 
+ * actions at a time, with the buttons and the command line seeing to 
+ * things in between. The other way around, command handlers that print a 
+ * lot (display, help) call taskYield() as they go to let wheelTask() have 
+ * its turns. So, however busy the rest is, the wheel waits no longer than 
+ * it takes to print a line or so.
+ * 
+ ****/
+
+// bool wheelTask() If a wheel moved, deal with it. Take the detents the ISR has queued since the last 
+// sequence was started (until some wheel has MAX_BATCH of them) and start playing the sequence for the next 
+// wheel, round robin, that has any, as startDetents() describes, with that wheel's plan. Play no more than 
+// PLAY_SLICE actions per call. On the ATmega32U4, first send the next queued HID report when it's time (see 
+// paceReports()), and only play actions while no more than REPORT_LOW_WATER reports are waiting. A new 
+// sequence isn't started until all of the last one's reports have been sent; the detents that come in the 
+// meantime are acted on together. Returns true if there are actions left to play or reports left to send.
+bool wheelTask() {
+    static int16_t pending[WHEELS];             // Each wheel's detents taken from eventRing but not yet acted on
+    static uint16_t interval[WHEELS];           // μs between each wheel's two most recent detents
+    static uint8_t lastWheel = 0;               // The wheel whose detents were played most recently
+    static bool playing = false;                // Actions for earlier detents are still being played
+    #ifdef BENCH_LATENCY
+    static uint32_t pendingCycles[WHEELS];      // benchCycles() when each wheel's oldest pending detent was detected
+    #endif
+    #ifdef __AVR_ATmega32U4__
+    paceReports();
+    if (reportsQueued() > (playing ? REPORT_LOW_WATER : 0)) {
+        return true;
+    }
+    #endif
+    if (!playing) {
+        #ifdef BENCH_LATENCY
+        benchPlayEnd();
+        #endif
+        wheelEvent ev;
+        bool room = true;
+        while (room && popEvent(ev)) {
+            int16_t &n = pending[ev.wheel];
+            #ifdef BENCH_LATENCY
+            if (n == 0) {
+                pendingCycles[ev.wheel] = ev.cycles;
+            }
+            #endif
+            n += ev.steps;
+            interval[ev.wheel] = ev.interval;
+            room = n > -MAX_BATCH && n < MAX_BATCH;
+        }
+        uint8_t w = lastWheel;
+        do {
+            w = w + 1 < WHEELS ? w + 1 : 0;
+        } while (pending[w] == 0 && w != lastWheel);
+        int16_t nDetents = constrain(pending[w], -MAX_BATCH, MAX_BATCH);
+        pending[w] -= nDetents;
+        if (nDetents == 0) {
+            return false;
+        }
+        lastWheel = w;
+        #ifdef DEBUG
+        #ifdef DEBUG_ISR
+        Serial.println(nDetents);
+        #else
+        Serial.print(nDetents > 0 ? F("+") : F(""));
+        Serial.print(nDetents);
+        #endif
+        #endif
+        #ifdef BENCH_LATENCY
+        benchPlayStart(pendingCycles[w]);
+        #endif
+        startDetents(player, plan[w], nDetents, interval[w]);
+    }
+    playing = playSome(player, PLAY_SLICE);
+    #ifdef __AVR_ATmega32U4__
+    return playing || reportsQueued() != 0;
+    #else
+    if (!playing) {
+        Serial.print(F("\n"));
+    }
+    return playing;
+    #endif
+}
+
+// void chordStep(uint8_t buttons, unsigned long when) Work out what button chord the user intends, if any, 
+// given that the (debounced) buttons down became buttons at millis() when or, if they're the same as before, 
+// that they still were at when. Chords are entered by pressing a combination of the three buttons and then 
+// releasing them. The buttons that were down for more than FINGER_MILLIS just before release is the chord 
+// the user entered.
+void chordStep(uint8_t buttons, unsigned long when) {
+    static uint8_t down = 0;                    // The buttons down
+    static unsigned long downMillis = 0;        // millis() when they went down
+    static uint8_t pendingCombo = 0;            // The chord entered so far, + 1. (0 until the first call)
+    if (down == 0 && pendingCombo != selection + 1) {   // If first time through or selected some other way
+        pendingCombo = selection + 1;
+        ledShow(pendingCombo);
+    }
+    if (down != 0 && down != pendingCombo && when - downMillis > FINGER_MILLIS) {
+        pendingCombo = down;
+        ledShow(pendingCombo);
+        #ifdef DEBUG
+        Serial.print(F("Chord: "));
+        Serial.println(pendingCombo);
+        #endif
+    }
+    if (buttons == down) {
+        return;
+    }
+    down = buttons;
+    downMillis = when;
+    buttonsDown = down != 0;
+    if (down == 0 && pendingCombo - 1 != selection) {
+        selection = pendingCombo - 1;
+        loadActiveConfig();                     // (Before the EEPROM gets busy writing)
+        writeSelection();
+        #ifdef DEBUG
+        Serial.print(F("Selection set to "));
+        Serial.print((const __FlashStringHelper *)ledColor[selection]);
+        Serial.print(F(" ("));
+        Serial.print(selection);
+        Serial.println(F(")"));
+        #endif
+    }
+}
+
+// void buttonTask() Debounce the button changes the ISR has reported and pass them on to chordStep(). A 
+// change is believed once the buttons have stayed that way for DEBOUNCE_MILLIS, and it counts as having 
+// happened when it was first seen, so how busy loop() is doesn't matter. Only while a change is waiting to 
+// be believed or a button is down does this need the time.
+void buttonTask() {
+    static uint8_t seen = 0;                    // The buttons down, as last reported by the ISR
+    static unsigned long seenMillis = 0;        // When the ISR saw that
+    static uint8_t settled = 0;                 // The buttons down, as last passed to chordStep()
+    static bool started = false;                // chordStep() has been called
+    buttonEvent ev;
+    while (popButton(ev)) {
+        if (ev.timestamp - seenMillis >= DEBOUNCE_MILLIS) {     // The previous change lasted long enough
+            settled = seen;
+            chordStep(seen, seenMillis);
+            chordStep(seen, ev.timestamp);
+        }
+        seen = ev.buttons;
+        seenMillis = ev.timestamp;
+    }
+    if (seen != settled || settled != 0 || !started) {
+        unsigned long now = millis();
+        if (now - seenMillis >= DEBOUNCE_MILLIS) {
+            settled = seen;
+            chordStep(seen, seenMillis);
+        }
+        chordStep(settled, now);
+        started = true;
+    }
+}
+
+// void calTask() Keep the coils' trigger and reset levels calibrated. Once nothing has happened for 
+// IDLE_MILLIS, have the ISR slow sampling down. (It speeds up again by itself on the first edge.)
+void calTask() {
+    static unsigned long activeMillis = 0;
+    static uint32_t activeEdges = 0;
+    unsigned long curMillis = millis();
+    uint32_t edges = allEdges();
+    if (edges != activeEdges || buttonsDown || capturing) {
+        activeEdges = edges;
+        activeMillis = curMillis;
+        idleWanted = false;
+    } else if (curMillis - activeMillis >= IDLE_MILLIS) {
+        idleWanted = true;
+    }
+
+    static unsigned long calMillis = 0;
+    if (curMillis >= CAL_WARMUP_MILLIS && curMillis - calMillis >= CAL_MILLIS) {
+        calMillis = curMillis;
+        calibrate();
+    }
+}
+
+// void uiTask() Do UI stuff: a command line (or a binary request, or a capture block) 
+void uiTask() {
+    if (binaryMode) {
+        binaryRun();
+    } else if (capturing) {
+        captureRun();
+    } else {
+        ui.run();
+    }
+
+    #ifdef DEBUG_ISR
+    // Dump collected ISR stats, if needed
+    if (dStateIx >= D_STATE_SIZE) {
+        Serial.println(F("Recorded state:"));
+        for (byte ix = 0; ix < D_STATE_SIZE; ix++) {
+            Serial.print(F("Sample "));
+            Serial.print(ix);
+            Serial.print(F(" queued: "));
+            Serial.print(dQueued[ix]);
+            Serial.print(F(" sampled coil "));
+            Serial.print(dCoil[ix] >> 1);
+            Serial.print((dCoil[ix] & 1) == COIL_A ? F("A, val: ") : F("B, val: "));
+            Serial.print(dCoilVal[ix]);
+            for (byte c = 0; c < 2; c++) {
+                coilState_t s = dState[ix][c];
+                Serial.print(F(" coil "));
+                Serial.print(c == 0 ? F("A: ") : F("B: "));
+                Serial.print(s == low ? F("  low") : s == rising ? F(" rising") : F(" rose"));
+                Serial.print(F(", ts: "));
+                Serial.print(dRisingTimestamp[ix][c]);
+                Serial.print(c == 1 ? F("\n") : F(", "));
+            }
+        }
+        dStateIx = 0;
+    }
+    #endif
+}
+
+// void ledTask() Every LED_MILLIS, work out how fast the wheel's been turning (from the steps the ISR has 
+// queued) and whether eventRing has been full, and update the LED to match. The activity goes up as soon as 
+// the wheel speeds up but fades a quarter of the way down at a time, so it doesn't flicker.
+void ledTask() {
+    static unsigned long ledMillis = 0;         // When the LED was last updated
+    static uint32_t lastSteps = 0;              // isrStats.steps then
+    static uint16_t lastFull = 0;               // isrStats.ringFull then
+    static unsigned long fullMillis = 0;        // When eventRing was last seen to have been full
+    unsigned long now = millis();
+    if (now - ledMillis < LED_MILLIS) {
+        return;
+    }
+    uint32_t steps;
+    uint16_t full;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        steps = isrStats.steps;
+        full = isrStats.ringFull;
+    }
+    uint32_t rate = (steps >= lastSteps ? steps - lastSteps : 0) * 1000UL / (now - ledMillis); // (stats reset resets them)
+    uint8_t target = rate >= LED_FULL_RATE ? 0xFF : rate * 0xFF / LED_FULL_RATE;
+    ledActivity = target >= ledActivity ? target : ledActivity - (ledActivity - target + 3) / 4;
+    if (full != lastFull && full != 0) {
+        fullMillis = now;
+        ledWarning = true;
+    } else if (now - fullMillis >= LED_WARN_MILLIS) {
+        ledWarning = false;
+    }
+    ledMillis = now;
+    lastSteps = steps;
+    lastFull = full;
+    ledUpdate();
+}
+
+// void taskYield() Give wheelTask() a turn. For things that take a while, like printing a lot.
+void taskYield() {
+    wheelTask();
+}
+
+// void printYielding(const __FlashStringHelper *text) Print text, a line of it (or PRINT_SLICE characters)
+// at a time, giving wheelTask() a turn after each, and then a newline
+void printYielding(const __FlashStringHelper *text) {
+    const char *p = (const char *)text;
+    char buf[PRINT_SLICE + 1];
+    uint8_t n;
+    do {
+        n = 0;
+        while (n < PRINT_SLICE && (buf[n] = pgm_read_byte(p + n)) != '\0' && buf[n++] != '\n') {
+        }
+        buf[n] = '\0';
+        Serial.print(buf);
+        p += n;
+        taskYield();
+    } while (pgm_read_byte(p) != '\0');
+    Serial.println();
+}
+
+/****
+ * 
+ * ui command handlers
+ * 
+ ****/
+
+// uint8_t wordToCbn(uint8_t n) Convert word n of the command line to a configuration block number, as toCbn()
+uint8_t wordToCbn(uint8_t n) {
+    char word[CLI_WORD_SIZE];
+    getWord(n, word);
+    return toCbn(word);
+}
+
+// Unknown
+void onUnknown() {
+    Serial.println(F("Unknown or unimplemented command."));
+}
+
+// help | h [new] Displays list of commands
+void onHelp() {
+    char word[CLI_WORD_SIZE];
+    getWord(1, word);
+    if (strcmp(word, "new") == 0) {
+        printYielding(F("JogWheel new command help\n"
+                         "To make a new configuration, type \"new <config>\" where\n"
+                         "  <config> = <spec> ( <spec>)*\n"
+                         "There can be up to 40 specs per configuration, separated by whitespace, as long as they fit in 255 bytes.\n"
+                         "  <spec> = (K|k)<k-spec> <k-spec> | (M|m)<m-spec> <m-spec> | (W|w)<w-spec> <w-spec> | (C|c)<c-spec> <c-spec>\n"
+                         "         | (H|h)<h-spec> <h-spec> | (U|u)<u-spec> <u-spec>\n"
+                         "The first <*-spec> in a pair tells what to do on a clockwise click of the jogwheel. The other does the same for counterclockwise.\n"
+                         "K means the action is a keystroke, M means a mouse movement spec, W means a mouse wheel roll, and C means a mouse click.\n"
+                         "H means a high-resolution mouse wheel roll, in 120ths of a wheel click, and U means a consumer control (media key).\n"
+                         "  <k-spec> = <k-modifiers><keystroke>\n"
+                         "  <m-spec> = <k-modifiers><m-modifiers><x-dist><y-dist>\n"
+                         "  <w-spec> = <k-modifiers><m-modifiers><wheel-amt>\n"
+                         "  <c-spec> = <k-modifiers><m-button>\n"
+                         "  <h-spec> = <k-modifiers><signed-num> (whose value must be -127..+127)\n"
+                         "  <u-spec> = <k-modifiers>(0X|0x)<hex-digit>[<hex-digit>][<hex-digit>] (a Consumer page usage, 0x001..0x7FF)\n"
+                         "  <k-modifiers> = [(c|C)][(a|A)][(s|S)][(g|G)]\n"
+                         "  <m-modifiers> = [(l|L)][(m|M)][(r|R)]\n"
+                         "  <keystroke> = \'<printable-char> | (0X|0x)<hex-digit><hex-digit>\n"
+                         "  <x-dist> = <signed-num>\n"
+                         "  <y-dist> = <signed-num>\n"
+                         "  <m-button> = (l|L)|(m|M)|(r|R)\n"
+                         "  <signed-num> = (+|-)[<dec-digit>][<dec-digit>]<dec-digit> (whose value must be -127..+127)\n"
+                         "  <dec-digit> = (0..9)\n"
+                         "  <hex-digit> = (0..9)|(A..F)|(a..f)\n"
+                         "  <printable-char> = a printable ascii character, including \'\n"
+                         "Any <*-spec> can end with *<count>, 1 <= <count> <= 16, to do it that many times in a row for each click.\n"
+                         "So \"k0xD9*10 0xDA*10\" moves 10 lines per click, but only takes 7 bytes.\n"
+                         "\"u0xE9 0xEA\" turns the volume up and down, and \"h+30 -30\" scrolls a quarter click per click.\n"
+                         "For example, \"k0xDA 0xD9\" is the default config."));
+    } else {
+        printYielding(F("JogWheel command list:\n"
+                         "  help [new]      Display this list of commands or the help for the new command\n"
+                         "  h [new]         Same as help\n"
+                         "  display         Display a list of the configurations\n"
+                         "  d               Same as display\n"
+                         "  new <config>    Specify a new configuration. (Type \"help new\" for help)\n"
+                         "  n <config>      Same as new\n"
+                         "  edit <n> <config> Change configuration <n> to <config>, 1 <= <n> <= 7\n"
+                         "  e <n> <config>  Same as edit\n"
+                         "  use <c> <n> [w] Use configuration <n> for button combo <c> on wheel [w] (default 0). <c> = 0: all up .. c = 7: all down\n"
+                         "  u <c> <n> [w]   Same as use\n"
+                         "  accel <n> <l>   Set acceleration level <l> for configuration <n>. 0: none .. 9: most\n"
+                         "  a <n> <l>       Same as accel\n"
+                         "  remove <n>      Remove configuration <n>, 1 <= <n> <= 7\n"
+                         "  r <n>           Same as remove\n"
+                         "  binary          Switch to the binary configuration protocol (for provisioning tools)\n"
+                         "  mem             Display how much RAM is in use and how little has been free\n"
+                         "  stats [reset]   Display (or reset) the wheel sampling and HID report counters\n"
+                         "  capture         Stream raw coil samples (in binary) until any character is sent"
+                         #ifdef BENCH_LATENCY
+                         "\n  latency [reset] Display (or reset) the detent to HID report latency histograms"
+                         #endif
+                         ));
+    }
+}
+
+// display | d  Display the list of available configurations
+void onDisplay() {
+    Serial.println(F("Button combination to configuraton map"));
+    Serial.print(F("Combo  Color   Config Number"));
+    Serial.println(WHEELS > 1 ? F(" (for each wheel)") : F(""));
+    for (uint8_t i = 0; i < N_ELEMENTS(header.curConfig[0]); i++){
+        Serial.print(F("    "));
+        Serial.print(i + 1);
+        Serial.print(F("  "));
+        Serial.print((const __FlashStringHelper *)ledColor[i]);
+        for (uint8_t w = 0; w < WHEELS; w++) {
+            Serial.print(F(" "));
+            Serial.print(header.curConfig[w][i]);
+        }
+        Serial.println();
+        taskYield();
+    }
+    Serial.println(F("Configuration number to <config> map"));
+    Serial.println(F("Number  Accel  <config>"));
+    for (uint8_t cbn = 0; cbn < N_ELEMENTS(header.configPtr) && header.configPtr[cbn] != 0; cbn++) {
+        cbReader r;
+        actionOp op[2];
+        Serial.print(F("     "));
+        Serial.print(cbn);
+        Serial.print(F("      "));
+        Serial.print(header.accel[cbn]);
+        Serial.print(F("  "));
+        eeHold();
+        openConfig(cbn, r);
+        while (getPair(r, op[ENTRY_CW], op[ENTRY_CC])) {
+            Serial.print(opLetter(op[ENTRY_CW].type));
+            printOp(op[ENTRY_CW]);
+            printOp(op[ENTRY_CC]);
+            taskYield();
+        }
+        eeRelease();
+        Serial.print(F("\n"));
+    }
+    Serial.print(F("There are "));
+    Serial.print(freeSpace());
+    Serial.println(F(" bytes free for configurations."));
+    for (uint8_t w = 0; w < WHEELS; w++) {
+        for (uint8_t c = 0; c < 2; c++) {
+            if (WHEELS > 1) {
+                Serial.print(F("Wheel "));
+                Serial.print(w);
+                Serial.print(F(" "));
+            }
+            Serial.print(c == COIL_A ? F("Coil A trigger level: ") : F("Coil B trigger level: "));
+            Serial.print(dec[w].triggerLevel[c]);
+            Serial.print(F(", reset level: "));
+            Serial.println(dec[w].resetLevel[c]);
+        }
+    }
+}
+
+// uint8_t takeReps(char *spec) If the <*-spec> spec ends in a repeat count, i.e., "*<count>", cut it off and 
+// return the count. If it doesn't, return 1. If the count is out of range, say so and return 0. (A "*" right 
+// after the "'" of a keystroke is the keystroke, not a repeat.)
+uint8_t takeReps(char *spec) {
+    char *star = strrchr(spec, '*');
+    if (star == NULL || star[1] == '\0' || (star > spec && star[-1] == '\'')) {
+        return 1;
+    }
+    for (const char *p = star + 1; *p != '\0'; p++) {
+        if (!isDigit(*p)) {
+            return 1;                           // (Whatever it is, parsing the <*-spec> will say it's wrong)
+        }
+    }
+    int reps = atoi(star + 1);
+    if (reps < 1 || reps > CB_MAX_REPS) {
+        Serial.print(F("Repeat count must be 1.."));
+        Serial.println(CB_MAX_REPS);
+        return 0;
+    }
+    *star = '\0';
+    return reps;
+}
+
+// bool parseConfig(uint8_t firstWord, cbWriter &w) Parse the <config> in the command line starting at 
+// word firstWord, putting its pairs of actions in the CB w is doing. Returns true if successful. If not, 
+// says what was wrong and returns false.
+bool parseConfig(uint8_t firstWord, cbWriter &w) {
+    bool bad = false;
+    for (uint8_t eNum = 0; !bad; eNum++) {
+        char spec[2][CLI_WORD_SIZE];
+        getWord(firstWord + 2*eNum, spec[0]);
+        getWord(firstWord + 1 + 2*eNum, spec[1]);
+        if (spec[0][0] == '\0') {
             break;
         }
+        if (spec[1][0] == '\0') {
+            bad = true;
+            Serial.println(F("Missing last <spec-cc>."));
+        }
+        actionOp op[2];
+        uint8_t st = spec[0][0];
+        char *sp[2] = {spec[0] + 1, spec[1]};   // The specs, less the <spec-type>
+        for (uint8_t dir = 0; dir < 2; dir ++) {
+            uint16_t entry = 0;
+            uint16_t entryY = 0;
+            bool direct = false;                // op[dir] was parsed into directly, not by way of entry
+            uint8_t reps = takeReps(sp[dir]);
+            if (st == 'M' || st == 'm') {
+                uint32_t doubleEntry = parseM(sp[dir]);
+                #ifdef DEBUG
+                Serial.print(F("parseM -- double entry: 0x"));
+                Serial.print(doubleEntry, HEX);
+                Serial.print(F(", dir: "));
+                Serial.println(dir);
+                #endif
+                entry = doubleEntry >> 16;
+                entryY = doubleEntry & 0xFFFF;
+            } else if (st == 'K' || st == 'k') {
+                entry = parseK(sp[dir]);
+            } else if (st == 'W' || st == 'w') {
+                entry = parseW(sp[dir]);
+            } else if (st == 'C' || st == 'c') {
+                entry = parseC(sp[dir]);
+            } else if (st == 'H' || st == 'h') {
+                direct = parseH(sp[dir], op[dir]);
+            } else if (st == 'U' || st == 'u') {
+                direct = parseU(sp[dir], op[dir]);
+            } else {
+                Serial.print(F("Invalid <spec> type: \'"));
+                Serial.print((char)st);
+                Serial.println(F("\'. Must be \'k\', \'m\', \'w\', \'c\', \'h\' or \'u\'."));
+            }
+            if ((entry == 0 && !direct) || reps == 0) {
+                bad = true;
+            } else {
+                if (!direct) {
+                    entryToOp(entry, entryY, op[dir]);
+                }
+                op[dir].reps = reps;
+            }
+        }
+        if (!bad && !putPair(w, op[ENTRY_CW], op[ENTRY_CC])) {
+            bad = true;
+            Serial.println(F("Too many entries for a config."));
+        }
+    }
+    if (!bad && cbSize(w) > CB_MAX_SIZE) {
+        bad = true;
+        Serial.println(F("Configuration too long."));
     }
     if (bad) {
         Serial.println(F("Could not add specification. Type \'help new\' for help."));
-        return;
+        return false;
     }
     #ifdef DEBUG
-    Serial.print(F(" Adding config:"));
-    for (uint8_t e = 0; e < cb.nEntries; e++) {
-        Serial.print(F(" "));
-        Serial.print(cb.entry[e][0], HEX);
-        Serial.print(F(" "));
-        Serial.print(cb.entry[e][1], HEX);
-    }
-    Serial.print(F("\n"));
+    Serial.print(F(" Parsed config: "));
+    Serial.print(w.nPairs);
+    Serial.print(F(" pairs, "));
+    Serial.print(cbSize(w));
+    Serial.println(w.mirrored ? F(" bytes, mirrored") : F(" bytes"));
     #endif
-    addConfig(cb);
+    return true;
 }
 
-// use | u <n> Use the configuration number <n>
+// Put the <config> of a new command in the CB w is doing. (A cbSource.)
+bool newConfig(cbWriter &w) {
+    return parseConfig(1, w);
+}
+
+// Put the <config> of an edit command in the CB w is doing. (A cbSource.)
+bool editConfig(cbWriter &w) {
+    return parseConfig(2, w);
+}
+
+// new | n <config> Add the new configuration <config> to the list of available configurations
+void onNew() {
+    cbWriter w;
+    beginConfig(w, 0, false);
+    if (newConfig(w) && !addConfig(w, newConfig)) {
+        Serial.println(F("Not enough room for another configuration."));
+    }
+}
+
+// edit | e <n> <config> Change configuration number <n> to <config>
+void onEdit() {
+    uint8_t n = wordToCbn(1);
+    if (n == 0 || n == N_ELEMENTS(header.configPtr)) {
+        Serial.print(F("To change a configuration, type \'edit <n> <config>\' where <n> is the configuration number. Currently, 1 <= <n> <= "));
+        Serial.println(nConfigs() - 1);
+        return;
+    }
+    cbWriter w;
+    beginConfig(w, 0, false);
+    if (editConfig(w) && !updateConfig(n, w, editConfig)) {
+        Serial.println(F("Not enough room for the changed configuration."));
+    }
+}
+
+// use | u <c> <n> [<w>] Use the configuration number <n> for button combo <c> (on wheel <w>)
 void onUse() {
-    int8_t combo = ui.getWord(1).toInt();
-    uint8_t cbn = toCbn(ui.getWord(2));
-    if (combo < 0 || (uint8_t)combo >= N_ELEMENTS(header.curConfig) || cbn == N_ELEMENTS(header.configPtr)) {
-        Serial.print(F("To set which configuration to use, type \'use <combo> <n>\' where <combo> is the button combination to set and\n"
-                       "<n> is the number of the configuration to use. Where 0 <= <combo> <= "));
-        Serial.print(N_ELEMENTS(header.curConfig) - 1);
+    char word[CLI_WORD_SIZE];
+    getWord(1, word);
+    int8_t combo = atoi(word);
+    uint8_t cbn = wordToCbn(2);
+    getWord(3, word);
+    int8_t w = atoi(word);                      // (0 if there's no <w>)
+    if (combo < 0 || (uint8_t)combo >= N_ELEMENTS(header.curConfig[0]) || cbn == N_ELEMENTS(header.configPtr) || 
+            w < 0 || w >= WHEELS) {
+        Serial.print(F("To set which configuration to use, type \'use <combo> <n> [<wheel>]\' where <combo> is the button combination\n"
+                       "to set, <n> is the number of the configuration to use and <wheel> (default 0) the wheel to use it for. Where\n"
+                       "0 <= <combo> <= "));
+        Serial.print(N_ELEMENTS(header.curConfig[0]) - 1);
+        Serial.print(F(", 0 <= <wheel> <= "));
+        Serial.print(WHEELS - 1);
         Serial.print(F(" and currently, 0 <= <n> <= "));
         Serial.println(nConfigs() - 1);
         return;
     }
-    header.curConfig[combo] = cbn;
-    writeHeader();
+    setConfig(w, combo, cbn);
+}
+
+// accel | a <n> <level> Set the acceleration level of configuration number <n>
+void onAccel() {
+    uint8_t cbn = wordToCbn(1);
+    char level[CLI_WORD_SIZE];
+    getWord(2, level);
+    if (cbn == N_ELEMENTS(header.configPtr) || !isDigit(level[0]) || !setAccel(cbn, atoi(level))) {
+        Serial.print(F("To set a configuration's acceleration, type \'accel <n> <level>\' where <n> is the configuration number and\n"
+                       "<level> is 0 (no acceleration) to "));
+        Serial.print(ACCEL_MAX_LEVEL);
+        Serial.print(F(". Currently, 0 <= <n> <= "));
+        Serial.println(nConfigs() - 1);
+    }
+}
+
+// binary  Switch the serial port to the binary configuration protocol
+void onBinary() {
+    Serial.println(F("Binary mode."));
+    binaryMode = true;
+}
+
+// capture  Stream raw coil samples over the serial port until something arrives there
+void onCapture() {
+    Serial.println(F("Capture mode. Send anything to stop."));
+    Serial.flush();
+    capIx = 0;                                  // (The ISR leaves all this alone until capturing is set)
+    capSeq = 0;
+    capDropped = 0;
+    capSend = 0;
+    capFill = 0;
+    capFull[0] = false;
+    capFull[1] = false;
+    idleWanted = false;                         // (Samples are only captured at full speed)
+    __asm__ __volatile__ ("" ::: "memory");
+    capturing = true;
+}
+
+// mem  Display how much of the RAM is in use
+void onMem() {
+    uint16_t stackNow = RAMEND - SP;
+    Serial.print(F("RAM: "));
+    Serial.print(RAMEND + 1 - RAMSTART);
+    Serial.print(F(" bytes. Globals: "));
+    Serial.print((uint8_t *)&__heap_start - (uint8_t *)RAMSTART);
+    Serial.print(F(", heap: "));
+    Serial.print(heapTop() - (uint8_t *)&__heap_start);
+    Serial.print(F(", stack: "));
+    Serial.println(stackNow);
+    Serial.print(F("Free now: "));
+    Serial.print(ramFree());
+    Serial.print(F(" bytes. Least free since reset: "));
+    Serial.print(ramLowWater());
+    Serial.println(F(" bytes."));
+}
+
+// uint32_t ticksToNs(uint16_t ticks) Convert Timer 1 (clk/8) ticks to ns
+uint32_t ticksToNs(uint16_t ticks) {
+    return (uint32_t)ticks * (uint16_t)(8000000000ULL / F_CPU);
+}
+
+// uint32_t rate(uint32_t n, unsigned long ms) Return n per ms ms as a per-second rate (without 64-bit arithmetic)
+uint32_t rate(uint32_t n, unsigned long ms) {
+    if (ms == 0) {
+        return 0;
+    }
+    uint32_t r = n % ms;
+    return n / ms * 1000 + (ms < 4000000UL ? r * 1000 / ms : r / (ms / 1000));
+}
+
+// stats [reset]  Display the acquisition and HID report counters or reset them
+void onStats() {
+    char word[CLI_WORD_SIZE];
+    getWord(1, word);
+    if (strcmp(word, "reset") == 0) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            isrStats.samples = 0;
+            isrStats.steps = 0;
+            isrStats.ringFull = 0;
+            isrStats.minTicks = 0xFFFF;
+            isrStats.maxTicks = 0;
+            isrStats.avgTicks = 0;
+        }
+        statsEdges = allEdges();
+        hidReports = hidFailures = 0;
+        #ifdef __AVR_ATmega32U4__
+        reportMostQueued = reportsQueued();
+        reportWaits = 0;
+        #endif
+        statsMillis = millis();
+        Serial.println(F("Counters reset."));
+        return;
+    }
+
+    // Take a snapshot so the ISR only waits for the copy, not the printing
+    isrCounters st;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        memcpy(&st, (const void *)&isrStats, sizeof(st));
+    }
+    uint32_t edges = allEdges() - statsEdges;
+    unsigned long elapsed = millis() - statsMillis;
+    Serial.print(F("In the last "));
+    Serial.print(elapsed);
+    Serial.print(F("ms: "));
+    Serial.print(st.samples);
+    Serial.print(F(" samples ("));
+    Serial.print(rate(st.samples, elapsed));
+    Serial.print(F("/s; should be "));
+    Serial.print(1000000UL / SAMPLE_US);
+    Serial.print(F("/s, "));
+    Serial.print(1000000UL / SAMPLE_US / IDLE_SLOWDOWN);
+    Serial.print(F("/s idle), "));
+    Serial.print(edges);
+    Serial.print(F(" edges, "));
+    Serial.print(st.steps);
+    Serial.print(F(" steps, eventRing full "));
+    Serial.print(st.ringFull);
+    Serial.println(F(" times"));
+    Serial.print(F("ISR run time (ns): min "));
+    Serial.print(st.samples == 0 ? 0 : ticksToNs(st.minTicks));
+    Serial.print(F(", avg "));
+    Serial.print(ticksToNs(st.avgTicks) >> STATS_SHIFT);
+    Serial.print(F(", max "));
+    Serial.println(ticksToNs(st.maxTicks));
+    #ifdef __AVR_ATmega32U4__
+    Serial.print(F("HID reports sent: "));
+    Serial.print(hidReports);
+    Serial.print(F(", failed: "));
+    Serial.println(hidFailures);
+    Serial.print(F("HID report queue: "));
+    Serial.print(reportsQueued());
+    Serial.print(F(" waiting, at most "));
+    Serial.print(reportMostQueued);
+    Serial.print(F(" of "));
+    Serial.print(REPORT_QUEUE_SIZE - 1);
+    Serial.print(F(", full "));
+    Serial.print(reportWaits);
+    Serial.println(F(" times"));
+    #endif
+}
+
+#ifdef BENCH_LATENCY
+// void printColumn(uint32_t v) Print v right-aligned in a 6-character column
+void printColumn(uint32_t v) {
+    for (uint32_t w = 100000; w > 1 && v < w; w /= 10) {
+        Serial.print(F(" "));
+    }
+    Serial.print(v);
 }
 
+// void printLatency(const __FlashStringHelper *name, const latencyHist &h) Print h's bins and longest 
+// latency on a line, starting with name, if there's anything in it
+void printLatency(const __FlashStringHelper *name, const latencyHist &h) {
+    if (h.maxCycles == 0) {
+        return;
+    }
+    Serial.print(name);
+    for (uint8_t bin = 0; bin < LAT_BINS; bin++) {
+        printColumn(h.count[bin]);
+    }
+    Serial.print(F("  max "));
+    Serial.print(h.maxCycles / (F_CPU / 1000000UL));
+    Serial.println(F("us"));
+}
+
+// latency [reset]  Display the detent to HID report latency histograms or reset them
+void onLatency() {
+    char word[CLI_WORD_SIZE];
+    getWord(1, word);
+    if (strcmp(word, "reset") == 0) {
+        memset(&latQueued, 0, sizeof(latQueued));
+        memset(&latReport, 0, sizeof(latReport));
+        memset(latFirst, 0, sizeof(latFirst));
+        memset(latLast, 0, sizeof(latLast));
+        Serial.println(F("Latency histograms reset."));
+        return;
+    }
+    Serial.print(F("Latency (us) below "));
+    for (uint8_t bin = 0; bin < LAT_BINS; bin++) {
+        if (bin < LAT_BINS - 1) {
+            printColumn(16UL << bin);
+        } else {
+            Serial.print(F("  more"));
+        }
+    }
+    Serial.println();
+    printLatency(F("Queued for wheel    "), latQueued);
+    printLatency(F("Each HID report     "), latReport);
+    for (uint8_t s = 0; s < N_ELEMENTS(latFirst); s++) {
+        if (latFirst[s].maxCycles == 0) {
+            continue;
+        }
+        Serial.print(F("Combo "));
+        Serial.print(s + 1);
+        Serial.print(F(" "));
+        Serial.print((const __FlashStringHelper *)ledColor[s]);
+        Serial.print(F("config "));
+        Serial.print(header.curConfig[0][s]);
+        Serial.println(F(":"));
+        printLatency(F("  First HID report  "), latFirst[s]);
+        printLatency(F("  Last HID report   "), latLast[s]);
+    }
+}
+#endif
+
 // remove || r <n> Remove configuration number <n> from the list of configurations
 void onRemove() {
-    uint8_t n = toCbn(ui.getWord(1));
+    uint8_t n = wordToCbn(1);
     if (n == 0 || n == N_ELEMENTS(header.configPtr)) {
         Serial.print(F("To remove a configuration, type \'remove <n>\' where <n> is the configuration number. Currently, 1 <= <n> <= "));
         Serial.println(nConfigs() - 1);
+        return;
     }
     removeConfig(n);
 }
@@ -1211,9 +3591,7 @@ void onRemove() {
  * 
  ****/
 void setup() {
-    // Setup GPIO pins
-    pinMode(COIL_A_PIN, INPUT);
-    pinMode(COIL_B_PIN, INPUT);
+    // Setup GPIO pins. (The coil pins are inputs from reset on; the ADC doesn't care anyway.)
     pinMode(LED_R, OUTPUT);
     pinMode(LED_G, OUTPUT);
     pinMode(LED_B, OUTPUT);
@@ -1240,25 +3618,60 @@ void setup() {
     ui.attachCmdHandler("d", onDisplay) &&
     ui.attachCmdHandler("new", onNew) &&
     ui.attachCmdHandler("n", onNew) &&
+    ui.attachCmdHandler("edit", onEdit) &&
+    ui.attachCmdHandler("e", onEdit) &&
     ui.attachCmdHandler("use", onUse) &&
     ui.attachCmdHandler("u", onUse) &&
+    ui.attachCmdHandler("accel", onAccel) &&
+    ui.attachCmdHandler("a", onAccel) &&
     ui.attachCmdHandler("remove", onRemove) &&
-    ui.attachCmdHandler("r", onRemove);
+    ui.attachCmdHandler("r", onRemove) &&
+    ui.attachCmdHandler("binary", onBinary) &&
+    ui.attachCmdHandler("mem", onMem) &&
+    ui.attachCmdHandler("stats", onStats) &&
+    ui.attachCmdHandler("capture", onCapture)
+    #ifdef BENCH_LATENCY
+    && ui.attachCmdHandler("latency", onLatency)
+    #endif
+    ;
     if (!succeeded) {
         Serial.println(F("Too many UI command handlers."));
     }
 
-    // Initialize our configuration header
+    // Initialize our configuration header and get the selected configuration
     readHeader();
+    loadActiveConfig();
+
+    #ifdef BENCH_LATENCY
+    // Start counting CPU cycles for the latency benchmark
+    benchStart();
+    #endif
+
+    // Start out with the coil levels calibrated last time
+    for (uint8_t w = 0; w < WHEELS; w++) {
+        initDecoder(dec[w]);
+        dec[w].sampleUs = SAMPLE_US * WHEELS;   // (Each wheel gets every WHEELSth pair of samples)
+    }
+    loadLevels();
 
-    // Set up our Timer ISR -- which one depends on processor type
+    // Set up the ADC to be auto-triggered by Timer 1, interrupting when each conversion completes
+    for (uint8_t ch = 0; ch < N_ELEMENTS(coilMux); ch++) {
+        DIDR0 |= _BV(coilMux[ch] & 0x07);      // Digital input buffers not needed on analog inputs (MUX[2:0] is the channel)
+    }
     ATOMIC_BLOCK(ATOMIC_FORCEON) {
-        TCCRxA = 0x00;
-        TCCRxB = 0x00;                  // Stop Timer
-        OCRxA = 0xFF;                   // Set number (256) of 2μs clock ticks per interrupt == 1 every 512μs
-        TCCRxA = _BV(WGMx1);            // WGMx[2:0] = 0x2 i.e., Set "Clear Timer on Compare" (CTC) mode
-        TCCRxB = _BV(CSx1) | _BV(CSx0); // CSx[2:0] = 0x3  i.e., Clock/64 (From prescaler)
-        TIMSKx |= _BV(OCIExA);          // Turn on OCRxA compare interrupts
+        TCCR1A = 0x00;
+        TCCR1B = 0x00;                  // Stop Timer
+        TIMSK1 = 0x00;                  // No Timer 1 interrupts; we only want its compare match B flag
+        TCNT1 = 0;
+        OCR1A = SAMPLE_TICKS - 1;       // Set number of 0.5μs clock ticks per cycle: one cycle every SAMPLE_US μs
+        OCR1B = SAMPLE_TICKS - 1;       // Compare match B at the top of each cycle triggers the ADC
+        TIFR1 = _BV(OCF1B);
+        ADMUX = coilMux[0];
+        ADCSRB = _BV(ADTS2) | _BV(ADTS0);           // ADTS = 0x5 i.e., auto-trigger on Timer 1 compare match B
+        ADCSRA = _BV(ADEN) | _BV(ADATE) | _BV(ADIE) | _BV(ADIF) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);  
+                                        // Enable, auto-trigger, interrupt; ADC clock / 128 (125kHz, within the 
+                                        // 200kHz full accuracy limit; ADC_CONVERSION_US per conversion)
+        TCCR1B = _BV(WGM12) | _BV(CS11);            // WGM1[3:0] = 0x4  i.e., CTC mode, CS1[2:0] = 0x2 i.e., Clock/8
     }
 
     // Hello world!
@@ -1272,233 +3685,17 @@ void setup() {
  * 
  ****/
 void loop() {
-    // If the wheel moved, deal with it.
-    if (movement != none) {
-        #ifdef DEBUG
-        #ifdef DEBUG_ISR
-        Serial.println(movement == cw ? F("+") : F("-"));
-        #else
-        Serial.print(movement == cw ? F("+") : F("-"));
-        #endif
-        #endif
-        uint8_t dir = movement == cw ? 0 : 1;
-        configBlock cb;
-        readConfig(header.curConfig[header.selection], cb);
-        for (uint8_t e = 0; e < cb.nEntries; e++) {
-            uint16_t entryA = cb.entry[e][dir];
-            char eType;
-            uint8_t m;
-            uint16_t entryB;
-            if ((entryA & CE_TYPE_MASK) == 0) {
-                eType = 'k';
-            } else {
-                uint8_t meType = ME_TYPE(cb.entry[e][dir]);
-                eType = meType == ME_TYPE_CLICK ? 'c' : meType == ME_TYPE_WHEEL ? 'w' : 'm';
-            }
-            #ifndef __AVR_ATmega32U4__
-            Serial.print(eType);
-            #endif
-            switch (eType) {
-                case 'k':
-                    #ifdef __AVR_ATmega32U4__
-                    if ((entryA & KB_CTRL_MASK) != 0) {
-                        Keyboard.press(KEY_LEFT_CTRL);
-                    }
-                    if ((entryA & KB_ALT_MASK) != 0) {
-                        Keyboard.press(KEY_LEFT_ALT);
-                    }
-                    if ((entryA & KB_SHIFT_MASK) != 0) {
-                        Keyboard.press(KEY_LEFT_SHIFT);
-                    }
-                    if ((entryA & KB_GUI_MASK) != 0) {
-                        Keyboard.press(KEY_LEFT_GUI);
-                    }
-                    Keyboard.press(entryA & KB_VALUE_MASK);
-                    Keyboard.releaseAll();
-                    #else
-                    Serial.print(F("0x"));
-                    Serial.print(entryA, HEX);
-                    #endif
-                    break;
-                case 'm':
-                    #ifdef __AVR_ATmega32U4__
-                    m = (entryA & ME1_LEFT_MASK) != 0 ? MOUSE_LEFT : 0;
-                    m |= (entryA & ME1_MID_MASK) != 0 ? MOUSE_MIDDLE : 0;
-                    m |= (entryA & ME1_RIGHT_MASK) != 0 ? MOUSE_RIGHT : 0;
-                    Mouse.press(m);
-                    e++;
-                    entryB = cb.entry[e][dir];
-                    if ((entryB & ME_CTRL_MASK) != 0) {
-                        Keyboard.press(KEY_LEFT_CTRL);
-                    }
-                    if ((entryB & ME_ALT_MASK) != 0) {
-                        Keyboard.press(KEY_LEFT_ALT);
-                    }
-                    if ((entryB & ME_SHIFT_MASK) != 0) {
-                        Keyboard.press(KEY_LEFT_SHIFT);
-                    }
-                    if ((entryB & ME_GUI_MASK) != 0) {
-                        Keyboard.press(KEY_LEFT_GUI);
-                    }
-                    Mouse.move(entryA & ME_VALUE_MASK, entryB & ME_VALUE_MASK, 0);
-                    Keyboard.releaseAll();
-                    Mouse.release(MOUSE_LEFT | MOUSE_MIDDLE | MOUSE_RIGHT);
-                    #else
-                    Serial.print(F("0x"));
-                    Serial.print(cb.entry[e][dir], HEX);
-                    Serial.print(F(" 0x"));
-                    e++;
-                    Serial.print(cb.entry[e][dir], HEX);
-                    #endif
-                    break;
-                case 'w':
-                    #ifdef __AVR_ATmega32U4__
-                    if ((entryA & ME_CTRL_MASK) != 0) {
-                        Keyboard.press(KEY_LEFT_CTRL);
-                    }
-                    if ((entryA & ME_ALT_MASK) != 0) {
-                        Keyboard.press(KEY_LEFT_ALT);
-                    }
-                    if ((entryA & ME_SHIFT_MASK) != 0) {
-                        Keyboard.press(KEY_LEFT_SHIFT);
-                    }
-                    if ((entryA & ME_GUI_MASK) != 0) {
-                        Keyboard.press(KEY_LEFT_GUI);
-                    }
-                    Mouse.move(0, 0, entryA & ME_VALUE_MASK);
-                    Keyboard.releaseAll();
-                    #else
-                    Serial.print(F("0x"));
-                    Serial.print(entryA, HEX);
-                    #endif
-                    break;
-                case 'c':
-                    #ifdef __AVR_ATmega32U4__
-                    if ((entryA & ME_CTRL_MASK) != 0) {
-                        Keyboard.press(KEY_LEFT_CTRL);
-                    }
-                    if ((entryA & ME_ALT_MASK) != 0) {
-                        Keyboard.press(KEY_LEFT_ALT);
-                    }
-                    if ((entryA & ME_SHIFT_MASK) != 0) {
-                        Keyboard.press(KEY_LEFT_SHIFT);
-                    }
-                    if ((entryA & ME_GUI_MASK) != 0) {
-                        Keyboard.press(KEY_LEFT_GUI);
-                    }
-                    m = (entryA & ME3_LEFT_MASK) != 0 ? MOUSE_LEFT : 0;
-                    m |= (entryA & ME3_MID_MASK) != 0 ? MOUSE_MIDDLE : 0;
-                    m |= (entryA & ME3_RIGHT_MASK) != 0 ? MOUSE_RIGHT : 0;
-                    Mouse.click(m);
-                    Keyboard.releaseAll();
-                    #else
-                    Serial.print(F("0x"));
-                    Serial.print(entryA, HEX);
-                    #endif
-                    break;
-                default:
-                    #ifndef __AVR_ATmega32U4__
-                    Serial.print(F("loop() -- Unrecognized type of configuration entry: "));
-                    Serial.println(eType);
-                    #endif
-                    break;
-            }
-            #ifndef __AVR_ATmega32U4__
-            Serial.print(F(" "));
-            #endif
-        }
-        #ifndef __AVR_ATmega32U4__
-        Serial.print(F("\n"));
-        #endif
-        movement = none;
-    }
+    // The tasks other than wheelTask(), in priority order
+    static void (*const task[])() = {buttonTask, calTask, uiTask, ledTask};
+    static uint8_t next = 0;                    // The one whose turn is next
 
-    // Do button stuff
-    static uint8_t button[3] = {0, 0, 0};
-    static unsigned long buttonMillis[3] = {0, 0, 0};
-    bool curButton[3] = {digitalRead(BUTTON_A) == LOW, digitalRead(BUTTON_B) == LOW, digitalRead(BUTTON_C) == LOW};
-    unsigned long curMillis = millis();
-    // Debounce the buttons
-    for (byte i = 0; i < 3; i++) {
-        if(curButton[i] != button[i]) {
-            if (buttonMillis[i] == 0) {
-                buttonMillis[i] = curMillis;
-            } else if (curMillis - buttonMillis[i] > DEBOUNCE_MILLIS) {
-                button[i] = curButton[i];
-                buttonMillis[i] = 0;
-            }
-        } else {
-            buttonMillis[i] = 0;
-        }
-    }
-
-    // Determine what button chord the user intends, if any. Chords are entered by pressing a combination 
-    // of the three buttons and then releasing them. The buttons that were down just before release is the chord
-    // the user entered.
-    static uint8_t pendingCombo = 0;
-    static unsigned long pendingMillis = 0;
-    uint8_t curCombo = button[2] << 2 | button[1] << 1 | button[0];
-    if (pendingCombo == 0) {                    // If first time through
-        pendingCombo = header.selection + 1;
-        digitalWrite(LED_R, (pendingCombo & 1) != 0 ? HIGH : LOW);
-        digitalWrite(LED_G, (pendingCombo & 2) != 0 ? HIGH : LOW);
-        digitalWrite(LED_B, (pendingCombo & 4) != 0 ? HIGH : LOW);
-    }
-    if (curCombo != 0) {
-        if (pendingCombo != curCombo) {
-            if (pendingMillis == 0) {
-                pendingMillis = curMillis;
-            } else if (curMillis - pendingMillis > FINGER_MILLIS) {
-                pendingCombo = curCombo;
-                pendingMillis = 0;
-                digitalWrite(LED_R, button[0] ? HIGH : LOW);
-                digitalWrite(LED_G, button[1] ? HIGH : LOW);
-                digitalWrite(LED_B, button[2] ? HIGH : LOW);
-                #ifdef DEBUG
-                Serial.print(F("Chord: "));
-                Serial.println(pendingCombo);
-                #endif
-            }
-        } else {
-            pendingMillis = 0;
-        }
-    } else if (pendingCombo - 1 != header.selection) {
-        header.selection = pendingCombo - 1;
-        writeHeader();
-        #ifdef DEBUG
-        Serial.print(F("Selection set to "));
-        Serial.print(ledColor[header.selection]);
-        Serial.print(F(" ("));
-        Serial.print(header.selection);
-        Serial.println(F(")"));
-        #endif
-    }
-      
-    // Do UI stuff
-    ui.run();
+    bool playing = wheelTask();
+    task[next]();
+    next = next + 1 < N_ELEMENTS(task) ? next + 1 : 0;
 
-    #ifdef DEBUG_ISR
-    // Dump collected ISR stats, if needed
-    if (dStateIx >= D_STATE_SIZE) {
-        Serial.println(F("Recorded state:"));
-        for (byte ix = 0; ix < D_STATE_SIZE; ix++) {
-            Serial.print(F("Sample "));
-            Serial.print(ix);
-            Serial.print(F(" moved: "));
-            Serial.print(dMovement[ix] == none ? F("no ") : dMovement[ix] == cc ? F("cc ") : F("cw "));
-            for (byte c = 0; c < 2; c++) {
-                coilState_t s = dState[ix][c];
-                Serial.print(F(" coil "));
-                Serial.print(c == 0 ? F("A: ") : F("B: "));
-                Serial.print(s == low ? F("  low") : s == rising ? F(" rising") : F(" rose"));
-                Serial.print(F(", val: "));
-                Serial.print(dCoilVal[ix][c]);
-                Serial.print(F(", ts: "));
-                Serial.print(dRisingTimestamp[ix][c]);
-                Serial.print(c == 1 ? F("\n") : F(", "));
-            }
-        }
-        dStateIx = 0;
+    // While idle, sleep until the next interrupt: a sample, millis() ticking over, USB or the serial port
+    if (sampleSlow && !playing) {
+        set_sleep_mode(SLEEP_MODE_IDLE);
+        sleep_mode();
     }
-    #endif
 }
\ No newline at end of file
@@ -0,0 +1,181 @@
+/****
+ * JogWheel compile-time pin mapping
+ *
+ * digitalRead() and digitalWrite() look up which port and bit an Arduino
+ * pin number is on in PROGMEM tables every time they're called, and check
+ * for PWM while they're at it, which takes dozens of cycles. Here, the same
+ * mapping is done with constexpr tables, so that for a pin number known at
+ * compile time, fastPin<pin>::high() and the like compile to a single sbi,
+ * cbi or sbic instruction.
+ *
+ * pinGroup<p0, p1, p2> does the same for three pins treated as a 3-bit
+ * value, bit 0 on p0: write() does one read-modify-write, which no ISR
+ * can come in the middle of, and read() one read per port the pins are on. Which ports those are depends on the
+ * board. (On the Leonardo, the LED pins 6, 7 and 8 are on ports D, E and B
+ * and the buttons 3, 4 and 5 are on ports D and C; on the Uno, they're on
+ * ports D and B and all on port D.)
+ *
+ * Nothing here changes a pin's mode; that's still up to pinMode(). And
+ * none of it stops a timer from driving a pin that's set up for PWM.
+ *
+ * Copyright (C) 2020 D.L. Ehnebuske
+ *
+ * See decoder.h for the license.
+ *
+ ****/
+
+#ifndef PINS_H
+#define PINS_H
+#include <stdint.h>
+#include <util/atomic.h>
+
+// Compile time constants
+#define PIN_PORT_B          (0)         // Port index values, as in pinSpec[]. The PINx, DDRx and PORTx registers
+#define PIN_PORT_C          (1)         // for each port are together, 3 addresses apart, starting with port B...
+#define PIN_PORT_D          (2)
+#define PIN_PORT_E          (3)
+#define PIN_PORT_F          (4)
+#define PIN_PORTS           (5)
+#define PIN_REG_BASE        (0x23)      // ...at PINB's (memory) address, the same on the ATmega328P and ATmega32U4
+#define PIN_SPEC(port, bit) ((port) << 3 | (bit))
+#define PIN_NO_ADC          (0xFF)      // In pinAdc[]: the pin isn't an analog input
+
+// Arduino pin number to port and bit (PIN_SPEC()) and to ADC channel (or PIN_NO_ADC) maps
+#if defined(__AVR_ATmega32U4__)
+constexpr uint8_t pinSpec[] = {                                     // As in the Leonardo's pins_arduino.h
+    PIN_SPEC(PIN_PORT_D, 2), PIN_SPEC(PIN_PORT_D, 3), PIN_SPEC(PIN_PORT_D, 1), PIN_SPEC(PIN_PORT_D, 0),   // D0..D3
+    PIN_SPEC(PIN_PORT_D, 4), PIN_SPEC(PIN_PORT_C, 6), PIN_SPEC(PIN_PORT_D, 7), PIN_SPEC(PIN_PORT_E, 6),   // D4..D7
+    PIN_SPEC(PIN_PORT_B, 4), PIN_SPEC(PIN_PORT_B, 5), PIN_SPEC(PIN_PORT_B, 6), PIN_SPEC(PIN_PORT_B, 7),   // D8..D11
+    PIN_SPEC(PIN_PORT_D, 6), PIN_SPEC(PIN_PORT_C, 7), PIN_SPEC(PIN_PORT_B, 3), PIN_SPEC(PIN_PORT_B, 1),   // D12..D15
+    PIN_SPEC(PIN_PORT_B, 2), PIN_SPEC(PIN_PORT_B, 0), PIN_SPEC(PIN_PORT_F, 7), PIN_SPEC(PIN_PORT_F, 6),   // D16, D17, A0, A1
+    PIN_SPEC(PIN_PORT_F, 5), PIN_SPEC(PIN_PORT_F, 4), PIN_SPEC(PIN_PORT_F, 1), PIN_SPEC(PIN_PORT_F, 0),   // A2..A5
+    PIN_SPEC(PIN_PORT_D, 4), PIN_SPEC(PIN_PORT_D, 7), PIN_SPEC(PIN_PORT_B, 4), PIN_SPEC(PIN_PORT_B, 5),   // A6..A9
+    PIN_SPEC(PIN_PORT_B, 6), PIN_SPEC(PIN_PORT_D, 6)                                                      // A10, A11
+};
+constexpr uint8_t pinAdc[] = {
+    PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC,   // D0..D7
+    PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC,   // D8..D15
+    PIN_NO_ADC, PIN_NO_ADC, 7, 6, 5, 4, 1, 0,                                                         // D16, D17, A0..A5
+    8, 10, 11, 12, 13, 9                                                                              // A6..A11
+};
+#elif defined(__AVR_ATmega328P__)
+constexpr uint8_t pinSpec[] = {                                     // As in the Uno's pins_arduino.h
+    PIN_SPEC(PIN_PORT_D, 0), PIN_SPEC(PIN_PORT_D, 1), PIN_SPEC(PIN_PORT_D, 2), PIN_SPEC(PIN_PORT_D, 3),   // D0..D3
+    PIN_SPEC(PIN_PORT_D, 4), PIN_SPEC(PIN_PORT_D, 5), PIN_SPEC(PIN_PORT_D, 6), PIN_SPEC(PIN_PORT_D, 7),   // D4..D7
+    PIN_SPEC(PIN_PORT_B, 0), PIN_SPEC(PIN_PORT_B, 1), PIN_SPEC(PIN_PORT_B, 2), PIN_SPEC(PIN_PORT_B, 3),   // D8..D11
+    PIN_SPEC(PIN_PORT_B, 4), PIN_SPEC(PIN_PORT_B, 5), PIN_SPEC(PIN_PORT_C, 0), PIN_SPEC(PIN_PORT_C, 1),   // D12, D13, A0, A1
+    PIN_SPEC(PIN_PORT_C, 2), PIN_SPEC(PIN_PORT_C, 3), PIN_SPEC(PIN_PORT_C, 4), PIN_SPEC(PIN_PORT_C, 5)    // A2..A5
+};
+constexpr uint8_t pinAdc[] = {
+    PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC,   // D0..D7
+    PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC, PIN_NO_ADC, 0, 1,                     // D8..D13, A0, A1
+    2, 3, 4, 5                                                                                        // A2..A5
+};
+#endif
+
+// constexpr uint8_t pinPort(uint8_t pin) The port (PIN_PORT_x) Arduino pin pin is on
+constexpr uint8_t pinPort(uint8_t pin) {
+    return pinSpec[pin] >> 3;
+}
+
+// constexpr uint8_t pinMask(uint8_t pin) The bit in its port's registers Arduino pin pin is
+constexpr uint8_t pinMask(uint8_t pin) {
+    return 1 << (pinSpec[pin] & 0x07);
+}
+
+// constexpr uint8_t pinAdcChannel(uint8_t pin) The ADC channel Arduino pin pin is, or PIN_NO_ADC
+constexpr uint8_t pinAdcChannel(uint8_t pin) {
+    return pinAdc[pin];
+}
+
+// volatile uint8_t &portIn(uint8_t port), &portOut(uint8_t port) The PINx or PORTx register of port port
+// (PIN_PORT_x). With port known at compile time, these are the same as using PINx or PORTx.
+inline volatile uint8_t &portIn(uint8_t port) {
+    return *(volatile uint8_t *)(uintptr_t)(PIN_REG_BASE + 3 * port);
+}
+inline volatile uint8_t &portOut(uint8_t port) {
+    return *(volatile uint8_t *)(uintptr_t)(PIN_REG_BASE + 3 * port + 2);
+}
+
+// Types
+template <uint8_t pin> struct fastPin {                             // An Arduino pin known at compile time
+    static_assert(pin < sizeof(pinSpec), "No such pin");
+    static inline void high() {                                     // Drive it (or pull it) high
+        portOut(pinPort(pin)) |= pinMask(pin);
+    }
+    static inline void low() {                                      // Drive it low (or let it float)
+        portOut(pinPort(pin)) &= ~pinMask(pin);
+    }
+    static inline void write(bool value) {                          // Drive it high if value, low if not
+        if (value) {
+            high();
+        } else {
+            low();
+        }
+    }
+    static inline bool read() {                                     // Whether it's high
+        return (portIn(pinPort(pin)) & pinMask(pin)) != 0;
+    }
+};
+
+template <uint8_t p0, uint8_t p1, uint8_t p2> struct pinGroup {    // Three Arduino pins as a 3-bit value, p0 is bit 0
+    static_assert(p0 < sizeof(pinSpec) && p1 < sizeof(pinSpec) && p2 < sizeof(pinSpec), "No such pin");
+
+    // constexpr uint8_t mask(uint8_t port) The bits of port port (PIN_PORT_x) the group's pins are
+    static constexpr uint8_t mask(uint8_t port) {
+        return (pinPort(p0) == port ? pinMask(p0) : 0) | (pinPort(p1) == port ? pinMask(p1) : 0) |
+            (pinPort(p2) == port ? pinMask(p2) : 0);
+    }
+
+    // Drive the pins high or low according to the bits of value. For each port the group has pins on, it's
+    // a single read-modify-write of the port's PORTx register, done so an ISR changing other pins of the port
+    // (as the USB core does with the RX and TX LEDs) can't come in between. (See writePort().)
+    static inline void write(uint8_t value) {
+        writePort<PIN_PORT_B>(value);
+        writePort<PIN_PORT_C>(value);
+        writePort<PIN_PORT_D>(value);
+        writePort<PIN_PORT_E>(value);
+        writePort<PIN_PORT_F>(value);
+    }
+
+    // Return which of the pins are high as a 3-bit value, reading each port's PINx register once
+    static inline uint8_t read() {
+        return readPort<PIN_PORT_B>() | readPort<PIN_PORT_C>() | readPort<PIN_PORT_D>() | readPort<PIN_PORT_E>() |
+            readPort<PIN_PORT_F>();
+    }
+
+    // The part of write() for port port. (The ifs are decided at compile time; so is all but value's part of 
+    // bits.) With only one of the pins on the port, it's an sbi or cbi, which can't be interrupted. With more, 
+    // interrupts are held off for the few cycles the read-modify-write takes.
+    template <uint8_t port> static inline void writePort(uint8_t value) {
+        if (mask(port) != 0) {
+            uint8_t bits = (pinPort(p0) == port && (value & 1) != 0 ? pinMask(p0) : 0) |
+                (pinPort(p1) == port && (value & 2) != 0 ? pinMask(p1) : 0) |
+                (pinPort(p2) == port && (value & 4) != 0 ? pinMask(p2) : 0);
+            if ((mask(port) & (mask(port) - 1)) == 0) {
+                if (bits != 0) {
+                    portOut(port) |= mask(port);
+                } else {
+                    portOut(port) &= ~mask(port);
+                }
+            } else {
+                ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                    portOut(port) = (portOut(port) & ~mask(port)) | bits;
+                }
+            }
+        }
+    }
+
+    // The part of read() for port port
+    template <uint8_t port> static inline uint8_t readPort() {
+        if (mask(port) == 0) {
+            return 0;
+        }
+        uint8_t in = portIn(port);
+        return (pinPort(p0) == port && (in & pinMask(p0)) != 0 ? 1 : 0) |
+            (pinPort(p1) == port && (in & pinMask(p1)) != 0 ? 2 : 0) |
+            (pinPort(p2) == port && (in & pinMask(p2)) != 0 ? 4 : 0);
+    }
+};
+
+#endif